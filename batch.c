@@ -0,0 +1,365 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "util.h"
+#include "snake.h"
+#include "pool/pool.h"
+
+// ========================================================
+// Manifest
+// ========================================================
+// CSV, one initial snake per row, '#' starts a comment:
+//
+//   image,circle,cx,cy,r,points
+//   image,contour,file
+//
+// where image is an .ics (or anything imageRead takes) or .npy file
+// and file holds one 'x,y' point per line. Consecutive rows of the
+// same image make one job: its energy is computed once and its snakes
+// are evolved together as one batch.
+#define MANIFEST_LINE 4096
+
+struct batchOptions {
+    double alpha;
+    double beta;
+    double gamma;
+    double sigma;
+    int niter;
+    double tol;
+    enum snakeEngine engine;
+    const char *cache;
+    double gvf;
+    int gvfIter;
+};
+
+struct job {
+    char *image;
+    struct contour **cons;
+    int ncons;
+    char *converged;
+    const struct batchOptions *opt;
+};
+
+static int hasSuffix(const char *s, const char *suffix) {
+    size_t n = strlen(s);
+    size_t m = strlen(suffix);
+    return n >= m && !strcmp(s + n - m, suffix);
+}
+
+static char *trim(char *s) {
+    while (*s == ' ' || *s == '\t')
+        s++;
+    char *e = s + strlen(s);
+    while (e > s && (e[-1] == ' ' || e[-1] == '\t'
+            || e[-1] == '\n' || e[-1] == '\r'))
+        *--e = '\0';
+    return s;
+}
+
+static struct contour *contourCircle(double cx, double cy, double r, int n) {
+    struct contour *con = contourNew();
+    for (int i = 0; i < n; i++) {
+        double t = 2 * 3.14159265358979323846 * i / n;
+        contourPush(con, cx + r * cos(t), cy + r * sin(t));
+    }
+    return con;
+}
+
+static struct contour *contourRead(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (!file)
+        DIE("Could not read file: %s\n", filename);
+    struct contour *con = contourNew();
+    char line[MANIFEST_LINE];
+    double x, y;
+    while (fgets(line, sizeof(line), file))
+        if (sscanf(line, "%lf , %lf", &x, &y) == 2)
+            contourPush(con, x, y);
+    fclose(file);
+    if (contourSize(con) < 5)
+        DIE("Contour needs at least 5 points: %s\n", filename);
+    return con;
+}
+
+static void jobAddContour(struct job *job, struct contour *con) {
+    job->cons = realloc(job->cons, sizeof(*job->cons) * (job->ncons + 1));
+    if (!job->cons)
+        DIE("Memory error\n");
+    job->cons[job->ncons++] = con;
+}
+
+static struct job *manifestRead(
+        const char *filename,
+        const struct batchOptions *opt,
+        int *njobs) {
+    FILE *file = fopen(filename, "r");
+    if (!file)
+        DIE("Could not read file: %s\n", filename);
+    struct job *jobs = NULL;
+    int n = 0;
+    char line[MANIFEST_LINE];
+    for (int row = 1; fgets(line, sizeof(line), file); row++) {
+        char *hash = strchr(line, '#');
+        if (hash)
+            *hash = '\0';
+        char *fields[6];
+        int nfields = 0;
+        char *rest = line;
+        char *f;
+        while (nfields < 6 && (f = strsep(&rest, ",")))
+            fields[nfields++] = trim(f);
+        if (nfields == 1 && !*fields[0])
+            continue;
+
+        struct contour *con = NULL;
+        if (nfields == 6 && !strcmp(fields[1], "circle")) {
+            int points = atoi(fields[5]);
+            if (points < 5)
+                DIE("%s:%d: a circle needs at least 5 points\n", filename, row);
+            con = contourCircle(
+                atof(fields[2]),
+                atof(fields[3]),
+                atof(fields[4]),
+                points);
+        } else if (nfields == 3 && !strcmp(fields[1], "contour"))
+            con = contourRead(fields[2]);
+        else
+            DIE("%s:%d: bad manifest row\n", filename, row);
+
+        if (!n || strcmp(jobs[n - 1].image, fields[0])) {
+            jobs = realloc(jobs, sizeof(*jobs) * (n + 1));
+            if (!jobs)
+                DIE("Memory error\n");
+            memset(&jobs[n], 0, sizeof(*jobs));
+            jobs[n].image = strdup(fields[0]);
+            jobs[n].opt = opt;
+            n++;
+        }
+        jobAddContour(&jobs[n - 1], con);
+    }
+    fclose(file);
+    *njobs = n;
+    return jobs;
+}
+
+// ========================================================
+// Jobs
+// ========================================================
+// A job reads its image, builds the energy and evolves its snakes;
+// the evolved contours replace the initial ones in the job. With as
+// many jobs as workers every job is one pool task (runJob) run on the
+// worker that picked it up, so many images are segmented at once and
+// no worker ever waits on another. With fewer, the jobs run one after
+// the other with the force and the batch of each spread over the pool
+// instead (p not NULL), so a single large image still uses every core.
+static void jobRun(struct job *job, struct pool *p) {
+    const struct batchOptions *opt = job->opt;
+
+    struct image *im = imageNew();
+    imageInit(im);
+    if (hasSuffix(job->image, ".npy")) {
+        int width, height;
+        float *pixels = npyRead(job->image, &width, &height);
+        imageSetData(im, pixels, width, height);
+        free(pixels);
+    } else
+        imageRead(im, job->image);
+
+    struct energy *en = energyNew();
+    energyInit(en);
+    if (opt->gvf > 0 && opt->cache)
+        energyLoadOrCalculateGVFPool(
+            en, im, opt->sigma, opt->gvf, opt->gvfIter, opt->cache, p);
+    else if (opt->gvf > 0)
+        energyCalculateGVFPool(en, im, opt->sigma, opt->gvf, opt->gvfIter, p);
+    else if (opt->cache)
+        energyLoadOrCalculateForcePool(en, im, opt->sigma, opt->cache, p);
+    else
+        energyCalculateForcePool(en, im, opt->sigma, p);
+    imageFree(im);
+
+    struct snakeBatch *b = snakeBatchNew();
+    snakeBatchInit(b, en, opt->alpha, opt->beta, opt->gamma, opt->engine);
+    snakeBatchSetTolerance(b, SNAKE_NORM_MAX, opt->tol);
+    energyFree(en);
+    for (int s = 0; s < job->ncons; s++)
+        snakeBatchAdd(b, job->cons[s]);
+    if (p)
+        snakeBatchExecPool(b, p, opt->niter);
+    else
+        snakeBatchExec(b, opt->niter);
+
+    job->converged = malloc(job->ncons);
+    if (!job->converged)
+        DIE("Memory error\n");
+    for (int s = 0; s < job->ncons; s++) {
+        snakeBatchGetContour(b, s, job->cons[s]);
+        job->converged[s] = snakeBatchConverged(b, s);
+    }
+    snakeBatchFree(b);
+}
+
+static void runJob(void *arg) {
+    jobRun(arg, NULL);
+}
+
+static void jobWrite(FILE *out, const struct job *job) {
+    for (int s = 0; s < job->ncons; s++) {
+        for (int i = 0; i < contourSize(job->cons[s]); i++) {
+            double x, y;
+            contourGetPoint(job->cons[s], i, &x, &y);
+            fprintf(out, "%s,%d,%d,%.4f,%.4f\n", job->image, s, i, x, y);
+        }
+    }
+}
+
+static void jobFree(struct job *job) {
+    for (int s = 0; s < job->ncons; s++)
+        contourFree(job->cons[s]);
+    free(job->cons);
+    free(job->converged);
+    free(job->image);
+}
+
+static void printUsage(const char *pro_name) {
+    fprintf(stderr,
+        "Usage: %s [OPTION]... <MANIFEST>\n" \
+        "\n"
+        "Evolves the snakes of a CSV manifest, one row per snake:\n"
+        "  image,circle,cx,cy,r,points\n"
+        "  image,contour,file             (file of 'x,y' lines)\n"
+        "and writes 'image,snake,point,x,y' rows.\n"
+        "\n"
+        "  -o FILE            Output file (default stdout)\n"
+        "  --alpha A          Elasticity of the snakes (0.001)\n"
+        "  --beta B           Rigidity of the snakes (0.4)\n"
+        "  --gamma G          Step size of the snakes (100)\n"
+        "  --sigma S          Scale of the image force (30)\n"
+        "  --iter N           Iterations per snake at most (200)\n"
+        "  --tol T            Largest point move of a converged snake (0.05)\n"
+        "  --engine E         banded, fft or dense (banded)\n"
+        "  --cache DIR        Keep the force fields on disk in DIR\n"
+        "  --gvf MU           Gradient vector flow force of smoothness MU\n"
+        "                     (0.2 is a good start, use a small sigma)\n"
+        "  --gvf-iter N       Solver sweeps per GVF level (50)\n"
+        "  --threads N        Workers (default one per CPU)\n",
+        pro_name
+    );
+}
+
+int main(int argc, char **argv) {
+    struct batchOptions opt;
+    opt.alpha = 0.001;
+    opt.beta = 0.4;
+    opt.gamma = 100;
+    opt.sigma = 30.0;
+    opt.niter = 200;
+    opt.tol = 0.05;
+    opt.engine = SNAKE_ENGINE_BANDED;
+    opt.cache = NULL;
+    opt.gvf = 0;
+    opt.gvfIter = 50;
+    const char *manifest = NULL;
+    const char *output = NULL;
+    struct poolAttr attr;
+    poolAttrInit(&attr);
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (arg[0] != '-') {
+            manifest = arg;
+            continue;
+        }
+        if (i + 1 == argc) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        const char *val = argv[++i];
+        if (!strcmp(arg, "-o"))
+            output = val;
+        else if (!strcmp(arg, "--alpha"))
+            opt.alpha = atof(val);
+        else if (!strcmp(arg, "--beta"))
+            opt.beta = atof(val);
+        else if (!strcmp(arg, "--gamma"))
+            opt.gamma = atof(val);
+        else if (!strcmp(arg, "--sigma"))
+            opt.sigma = atof(val);
+        else if (!strcmp(arg, "--iter"))
+            opt.niter = atoi(val);
+        else if (!strcmp(arg, "--tol"))
+            opt.tol = atof(val);
+        else if (!strcmp(arg, "--cache"))
+            opt.cache = val;
+        else if (!strcmp(arg, "--gvf"))
+            opt.gvf = atof(val);
+        else if (!strcmp(arg, "--gvf-iter"))
+            opt.gvfIter = atoi(val);
+        else if (!strcmp(arg, "--threads"))
+            attr.nworkers = atoi(val);
+        else if (!strcmp(arg, "--engine")) {
+            if (!strcmp(val, "banded"))
+                opt.engine = SNAKE_ENGINE_BANDED;
+            else if (!strcmp(val, "fft"))
+                opt.engine = SNAKE_ENGINE_FFT;
+            else if (!strcmp(val, "dense"))
+                opt.engine = SNAKE_ENGINE_DENSE;
+            else {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (!manifest) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    int njobs;
+    struct job *jobs = manifestRead(manifest, &opt, &njobs);
+
+    struct pool p;
+    poolInitAttr(&p, &attr);
+    poolCreateWorkers(&p);
+    if (njobs < poolWorkerCount(&p)) {
+        for (int j = 0; j < njobs; j++)
+            jobRun(&jobs[j], &p);
+    } else {
+        struct waitGroup wg;
+        waitGroupInit(&wg);
+        for (int j = 0; j < njobs; j++) {
+            struct task t = { runJob, &jobs[j], &wg };
+            poolAddTask(&p, t);
+        }
+        waitGroupWait(&wg);
+        waitGroupFree(&wg);
+    }
+    poolShutdown(&p);
+    poolDestroyWorkers(&p);
+    poolFree(&p);
+
+    FILE *out = output ? fopen(output, "w") : stdout;
+    if (!out)
+        DIE("Could not write file: %s\n", output);
+    fprintf(out, "image,snake,point,x,y\n");
+    long converged = 0, snakes = 0;
+    for (int j = 0; j < njobs; j++) {
+        jobWrite(out, &jobs[j]);
+        for (int s = 0; s < jobs[j].ncons; s++)
+            converged += jobs[j].converged[s];
+        snakes += jobs[j].ncons;
+        jobFree(&jobs[j]);
+    }
+    if (output && fclose(out))
+        DIE("Could not write file: %s\n", output);
+    free(jobs);
+    fprintf(stderr, "%d images, %ld snakes, %ld converged\n",
+        njobs, snakes, converged);
+    return 0;
+}
@@ -0,0 +1,341 @@
+#include <cmath>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <vector>
+#include <unistd.h>
+#include "snake.h"
+#include "internal.h"
+#include "force.h"
+#include "gauss.h"
+#include "gvf.h"
+extern "C" {
+#include "pool/pool.h"
+}
+
+// Benchmark suite
+// ========================================================
+// Times every stage of a snake run on its own and prints one CSV row
+// per measurement, all with the same columns (empty when a column
+// does not apply to the stage):
+//
+//   energy    force field build (gaussForce) of a w x h image at sigma
+//             on threads workers
+//   gvf       gradient vector flow (gvfForce) of the same image, mu 0.2
+//             and 50 sweeps per level, on threads workers
+//   operator  internal operator build of n points for engine
+//   sample-f64
+//   sample-f32
+//             bilinear force sampling (forceSampleSimd) of n double or
+//             float points from a field of type
+//   update    one internal step (internalSolve) of n points of type
+//   batch     one iteration of snakes snakes of n points each
+//             (snakeBatchExecPool) on threads workers, computing in
+//             type on a float field
+//
+// us is the time of one operation, the best of a few runs. The image
+// is a synthetic set of discs, the contours circles. `bench quick`
+// runs a reduced sweep.
+typedef std::chrono::steady_clock benchClock;
+
+struct benchRow {
+    const char *stage;
+    const char *engine;
+    const char *type;
+    int n;
+    int snakes;
+    int width;
+    int height;
+    double sigma;
+    int threads;
+};
+
+// Best time of one call of fn over reps runs, in microseconds.
+static double benchTime(const std::function<void()>& fn, int reps) {
+    double best = INFINITY;
+    for (int r = 0; r < reps; r++) {
+        benchClock::time_point start = benchClock::now();
+        fn();
+        std::chrono::duration<double, std::micro> d = benchClock::now() - start;
+        best = std::min(best, d.count());
+    }
+    return best;
+}
+
+static void benchPrint(const struct benchRow& row, double us) {
+    std::cout << row.stage << "," << row.engine << "," << row.type << ",";
+    if (row.n)
+        std::cout << row.n;
+    std::cout << ",";
+    if (row.snakes)
+        std::cout << row.snakes;
+    std::cout << ",";
+    if (row.width)
+        std::cout << row.width << "," << row.height;
+    else
+        std::cout << ",";
+    std::cout << ",";
+    if (row.sigma > 0)
+        std::cout << row.sigma;
+    std::cout << ",";
+    if (row.threads)
+        std::cout << row.threads;
+    std::cout << "," << us << std::endl;
+}
+
+static const char *engineName(enum snakeEngine engine) {
+    switch (engine) {
+        case SNAKE_ENGINE_BANDED:
+            return "banded";
+        case SNAKE_ENGINE_FFT:
+            return "fft";
+        case SNAKE_ENGINE_DENSE:
+            return "dense";
+    }
+    return "?";
+}
+
+static const char *typeName(enum snakeForceType type) {
+    return type == SNAKE_FORCE_FLOAT32 ? "f32" : "f64";
+}
+
+static std::vector<float> benchImage(int w, int h) {
+    std::vector<float> img((size_t) w * h);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            double dx = (x % 128) - 64;
+            double dy = (y % 128) - 64;
+            img[(size_t) y * w + x] = dx * dx + dy * dy < 40 * 40 ? 1 : 0;
+        }
+    }
+    return img;
+}
+
+static void benchCircle(int n, double cx, double cy, double r,
+        std::vector<double>& x, std::vector<double>& y) {
+    x.resize(n);
+    y.resize(n);
+    for (int i = 0; i < n; i++) {
+        x[i] = cx + r * cos(2 * M_PI * i / n);
+        y[i] = cy + r * sin(2 * M_PI * i / n);
+    }
+}
+
+static struct pool *benchPool(int threads) {
+    struct poolAttr a;
+    poolAttrInit(&a);
+    a.nworkers = threads;
+    struct pool *p = new pool();
+    poolInitAttr(p, &a);
+    poolCreateWorkers(p);
+    return p;
+}
+
+static void benchPoolFree(struct pool *p) {
+    poolShutdown(p);
+    poolDestroyWorkers(p);
+    poolFree(p);
+    delete p;
+}
+
+static void benchEnergy(int w, int h, double sigma, int threads) {
+    std::vector<float> img = benchImage(w, h);
+    struct pool *p = benchPool(threads);
+    struct forceField ff;
+    double us = benchTime([&] {
+        forceFieldInit(ff, w, h, SNAKE_FORCE_FLOAT32);
+        gaussForce(img.data(), w, h, sigma, ff, p);
+    }, 3);
+    benchPrint({ "energy", "", "f32", 0, 0, w, h, sigma, threads }, us);
+    benchPoolFree(p);
+}
+
+static void benchGVF(int w, int h, double sigma, int threads) {
+    std::vector<float> img = benchImage(w, h);
+    struct pool *p = benchPool(threads);
+    struct forceField ff;
+    double us = benchTime([&] {
+        forceFieldInit(ff, w, h, SNAKE_FORCE_FLOAT32);
+        gvfForce(img.data(), w, h, sigma, 0.2, 50, ff, p);
+    }, 3);
+    benchPrint({ "gvf", "", "f32", 0, 0, w, h, sigma, threads }, us);
+    benchPoolFree(p);
+}
+
+template <typename T>
+static const char *scalarName() {
+    return sizeof(T) == sizeof(float) ? "f32" : "f64";
+}
+
+template <typename T>
+static void benchOperator(enum snakeEngine engine, int n) {
+    struct internal<T> in;
+    double us = benchTime([&] {
+        internalInit(in, engine, 0.001, 0.4, 100, n);
+    }, 3);
+    benchPrint({ "operator", engineName(engine), scalarName<T>(),
+        n, 0, 0, 0, 0, 0 }, us);
+}
+
+template <typename T>
+static void benchUpdate(enum snakeEngine engine, int n) {
+    std::vector<double> cx;
+    std::vector<double> cy;
+    benchCircle(n, 120, 140, 50, cx, cy);
+    std::vector<T> x(cx.begin(), cx.end());
+    std::vector<T> y(cy.begin(), cy.end());
+    struct internal<T> in;
+    struct internalWork<T> work;
+    internalInit(in, engine, 0.001, 0.4, 100, n);
+    int niter = 20;
+    double us = benchTime([&] {
+        for (int i = 0; i < niter; i++)
+            internalSolve(in, x.data(), y.data(), work);
+    }, 3) / niter;
+    benchPrint({ "update", engineName(engine), scalarName<T>(),
+        n, 0, 0, 0, 0, 0 }, us);
+}
+
+template <typename T>
+static void benchSample(const struct forceField& ff, int n) {
+    std::vector<double> cx;
+    std::vector<double> cy;
+    benchCircle(n, ff.width / 2.0, ff.height / 2.0, ff.height / 3.0, cx, cy);
+    std::vector<T> x(cx.begin(), cx.end());
+    std::vector<T> y(cy.begin(), cy.end());
+    std::vector<T> fx(n);
+    std::vector<T> fy(n);
+    int niter = 20;
+    double us = benchTime([&] {
+        for (int i = 0; i < niter; i++)
+            forceSampleSimd(ff, x.data(), y.data(), n, fx.data(), fy.data());
+    }, 3) / niter;
+    const char *stage = sizeof(T) == sizeof(float) ? "sample-f32" : "sample-f64";
+    benchPrint({ stage, "", typeName(ff.type), n, 0,
+        ff.width, ff.height, 0, 0 }, us);
+}
+
+static void benchBatch(
+        struct energy *en,
+        int w,
+        int h,
+        enum snakeEngine engine,
+        enum snakePrecision precision,
+        int n,
+        int snakes,
+        int threads) {
+    struct pool *p = benchPool(threads);
+    struct snakeBatch *b = snakeBatchNew();
+    snakeBatchInit(b, en, 0.001, 0.4, 100, engine);
+    snakeBatchSetPrecision(b, precision);
+    std::vector<double> x;
+    std::vector<double> y;
+    int cols = w / 128;
+    int rows = h / 128;
+    for (int s = 0; s < snakes; s++) {
+        double cx = 64 + 128 * (s % cols);
+        double cy = 64 + 128 * (s / cols % rows);
+        benchCircle(n, cx, cy, 50, x, y);
+        struct contour *con = contourNew();
+        for (int i = 0; i < n; i++)
+            contourPush(con, x[i], y[i]);
+        snakeBatchAdd(b, con);
+        contourFree(con);
+    }
+    int niter = 10;
+    double us = benchTime([&] {
+        snakeBatchExecPool(b, p, niter);
+    }, 3) / niter;
+    const char *type = precision == SNAKE_PRECISION_FLOAT32 ? "f32" : "f64";
+    benchPrint({ "batch", engineName(engine), type, n, snakes,
+        w, h, 0, threads }, us);
+    snakeBatchFree(b);
+    benchPoolFree(p);
+}
+
+int main(int argc, char **argv) {
+    bool quick = argc > 1 && !strcmp(argv[1], "quick");
+    const std::vector<int> sizes = quick
+        ? std::vector<int> { 63, 1024 }
+        : std::vector<int> { 63, 256, 1024, 4096, 16384 };
+    const std::vector<int> images = quick
+        ? std::vector<int> { 256 }
+        : std::vector<int> { 256, 1024, 2048 };
+    const std::vector<double> sigmas = quick
+        ? std::vector<double> { 4 }
+        : std::vector<double> { 2, 8, 30 };
+    const std::vector<int> counts = quick
+        ? std::vector<int> { 1, 16 }
+        : std::vector<int> { 1, 16, 256 };
+    const enum snakeEngine engines[] = {
+        SNAKE_ENGINE_BANDED,
+        SNAKE_ENGINE_FFT,
+        SNAKE_ENGINE_DENSE
+    };
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    std::vector<int> threads;
+    for (int t = 1; t < ncpu; t *= 2)
+        threads.push_back(t);
+    threads.push_back(ncpu);
+
+    std::cout << "stage,engine,type,n,snakes,width,height,sigma,threads,us"
+              << std::endl;
+    for (int s : images)
+        for (double sigma : sigmas)
+            for (int t : threads)
+                benchEnergy(s, s, sigma, t);
+    for (int s : images)
+        for (int t : threads)
+            benchGVF(s, s, 2, t);
+
+    for (int n : sizes) {
+        for (enum snakeEngine engine : engines) {
+            // the dense reference gets slow quickly, keep it bounded
+            if (engine == SNAKE_ENGINE_DENSE && n > 4096)
+                continue;
+            benchOperator<double>(engine, n);
+            benchOperator<float>(engine, n);
+            benchUpdate<double>(engine, n);
+            benchUpdate<float>(engine, n);
+        }
+    }
+
+    int s = images.back();
+    std::vector<float> img = benchImage(s, s);
+    for (enum snakeForceType type : { SNAKE_FORCE_FLOAT32, SNAKE_FORCE_FLOAT64 }) {
+        struct forceField ff;
+        forceFieldInit(ff, s, s, type);
+        gaussForce(img.data(), s, s, 8, ff, NULL);
+        for (int n : sizes) {
+            benchSample<double>(ff, n);
+            benchSample<float>(ff, n);
+        }
+    }
+
+    struct image *im = imageNew();
+    struct energy *en = energyNew();
+    imageInit(im);
+    imageSetData(im, img.data(), s, s);
+    energyInit(en);
+    energyCalculateForce(en, im, 8);
+    for (int n : sizes) {
+        if (n > 4096)
+            continue;
+        for (int snakes : counts) {
+            for (int t : threads) {
+                // dense is only a reference, it has its own rows above
+                for (enum snakePrecision precision :
+                        { SNAKE_PRECISION_FLOAT64, SNAKE_PRECISION_FLOAT32 }) {
+                    benchBatch(en, s, s, SNAKE_ENGINE_BANDED, precision,
+                        n, snakes, t);
+                    benchBatch(en, s, s, SNAKE_ENGINE_FFT, precision,
+                        n, snakes, t);
+                }
+            }
+        }
+    }
+    energyFree(en);
+    imageFree(im);
+    return 0;
+}
@@ -0,0 +1,201 @@
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+static_assert(sizeof(struct cacheHeader) == 64, "cache header is 64 bytes");
+
+#define CACHE_ORDER 0x01020304u
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t n) {
+    const unsigned char *p = (const unsigned char *) data;
+    for (size_t i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+// One 64 bit word into h: a multiply only carries bits upwards, the
+// shift folds the high half back down (the murmur3 finaliser step).
+static inline uint64_t mixWord(uint64_t h, uint64_t w) {
+    h = (h ^ w) * 0xff51afd7ed558ccdull;
+    return h ^ (h >> 33);
+}
+
+// The n bytes at data as 64 bit words over four independent lanes,
+// so the multiplies of consecutive words overlap; the tail bytes go
+// through fnv1a.
+static uint64_t hashWords(uint64_t h, const void *data, size_t n) {
+    const unsigned char *p = (const unsigned char *) data;
+    uint64_t lane[4] = { h, h + 1, h + 2, h + 3 };
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        for (int k = 0; k < 4; k++) {
+            uint64_t w;
+            memcpy(&w, p + i + 8 * k, sizeof(w));
+            lane[k] = mixWord(lane[k], w);
+        }
+    }
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        lane[0] = mixWord(lane[0], w);
+    }
+    for (int k = 1; k < 4; k++)
+        lane[0] = mixWord(lane[0], lane[k]);
+    return fnv1a(lane[0], p + i, n - i);
+}
+
+uint64_t cacheHash(const float *img, int w, int h) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    hash = fnv1a(hash, &w, sizeof(w));
+    hash = fnv1a(hash, &h, sizeof(h));
+    return hashWords(hash, img, (size_t) w * h * sizeof(float));
+}
+
+uint64_t cacheHashGVF(uint64_t hash, double mu, int niter) {
+    hash = fnv1a(hash, "gvf", 3);
+    hash = fnv1a(hash, &mu, sizeof(mu));
+    return fnv1a(hash, &niter, sizeof(niter));
+}
+
+// The exact bits of v, two values that print alike by %g still get
+// files of their own.
+static unsigned long long doubleBits(double v) {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return bits;
+}
+
+std::string cachePath(
+        const char *dir,
+        uint64_t hash,
+        double sigma,
+        enum snakeForceType type) {
+    char name[128];
+    snprintf(name, sizeof(name), "%016llx-%016llx-%s.ff",
+        (unsigned long long) hash,
+        doubleBits(sigma),
+        type == SNAKE_FORCE_FLOAT32 ? "f32" : "f64");
+    return std::string(dir) + "/" + name;
+}
+
+std::string cachePathGVF(
+        const char *dir,
+        uint64_t hash,
+        double sigma,
+        double mu,
+        int niter,
+        enum snakeForceType type) {
+    char name[160];
+    snprintf(name, sizeof(name), "%016llx-%016llx-gvf-%016llx-%d-%s.ff",
+        (unsigned long long) hash,
+        doubleBits(sigma),
+        doubleBits(mu),
+        niter,
+        type == SNAKE_FORCE_FLOAT32 ? "f32" : "f64");
+    return std::string(dir) + "/" + name;
+}
+
+static size_t cacheDataSize(const struct forceField& ff) {
+    size_t elem = ff.type == SNAKE_FORCE_FLOAT32 ? sizeof(float) : sizeof(double);
+    return (size_t) ff.tilesX * ff.tilesY * FORCE_TILE_SIZE * elem;
+}
+
+bool cacheLoad(
+        const char *path,
+        uint64_t hash,
+        double sigma,
+        enum snakeForceType type,
+        struct forceField& ff) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    struct cacheHeader hd;
+    bool ok = fstat(fd, &st) == 0
+        && (size_t) st.st_size >= sizeof(hd)
+        && pread(fd, &hd, sizeof(hd), 0) == (ssize_t) sizeof(hd)
+        && memcmp(hd.magic, CACHE_MAGIC, sizeof(hd.magic)) == 0
+        && hd.version == CACHE_VERSION
+        && hd.order == CACHE_ORDER
+        && hd.tile == FORCE_TILE
+        && hd.type == (uint32_t) type
+        && hd.sigma == sigma
+        && hd.hash == hash
+        && hd.width >= 2
+        && hd.height >= 2;
+    if (ok) {
+        ff.width = hd.width;
+        ff.height = hd.height;
+        ff.tilesX = (hd.width + FORCE_TILE - 1) >> FORCE_TILE_SHIFT;
+        ff.tilesY = (hd.height + FORCE_TILE - 1) >> FORCE_TILE_SHIFT;
+        ff.type = type;
+        ok = hd.size == cacheDataSize(ff)
+            && (size_t) st.st_size == sizeof(hd) + hd.size;
+    }
+    void *base = MAP_FAILED;
+    if (ok)
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return false;
+
+    size_t length = st.st_size;
+    void *data = (char *) base + sizeof(hd);
+    ff.storage.reset(base, [length](void *p) { munmap(p, length); });
+    ff.f32 = type == SNAKE_FORCE_FLOAT32 ? (float *) data : NULL;
+    ff.f64 = type == SNAKE_FORCE_FLOAT64 ? (double *) data : NULL;
+    ff.lazy.reset();
+    return true;
+}
+
+bool cacheStore(
+        const char *path,
+        uint64_t hash,
+        double sigma,
+        const struct forceField& ff) {
+    if (ff.lazy)
+        return false;
+    struct cacheHeader hd;
+    memset(&hd, 0, sizeof(hd));
+    memcpy(hd.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    hd.version = CACHE_VERSION;
+    hd.order = CACHE_ORDER;
+    hd.tile = FORCE_TILE;
+    hd.type = ff.type;
+    hd.width = ff.width;
+    hd.height = ff.height;
+    hd.sigma = sigma;
+    hd.hash = hash;
+    hd.size = cacheDataSize(ff);
+
+    // every store writes a file of its own, several threads may store
+    // the same field at once and the last rename wins
+    static std::atomic<unsigned> serial(0);
+    std::string tmp = std::string(path) + "." + std::to_string(getpid())
+        + "." + std::to_string(serial++);
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0)
+        return false;
+    FILE *file = fdopen(fd, "wb");
+    if (!file) {
+        close(fd);
+        unlink(tmp.c_str());
+        return false;
+    }
+    const void *data = ff.f32 ? (const void *) ff.f32 : (const void *) ff.f64;
+    bool ok = fwrite(&hd, sizeof(hd), 1, file) == 1
+        && fwrite(data, 1, hd.size, file) == hd.size;
+    ok = fclose(file) == 0 && ok;
+    if (ok)
+        ok = rename(tmp.c_str(), path) == 0;
+    if (!ok)
+        unlink(tmp.c_str());
+    return ok;
+}
@@ -0,0 +1,75 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <cstdint>
+#include <string>
+#include "force.h"
+
+// Force field cache
+// ========================================================
+// A computed force field on disk: a 64 byte header followed by the
+// tiles exactly as they are in memory (force.h), so a hit is one mmap
+// and the field points straight into the mapping. Files are keyed by
+// a hash of the image content, the exact bits of sigma (and of mu and
+// niter for GVF) and the value type; the header repeats the key and
+// load rejects any file that does not match it, was written with
+// another layout version, tile size or byte order, or is truncated. Files are written to a temporary name and renamed,
+// so readers never see half a file.
+#define CACHE_MAGIC "SNAKEFF"
+#define CACHE_VERSION 2
+
+struct cacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t order;    // 0x01020304 in the writer's byte order
+    uint32_t tile;     // FORCE_TILE
+    uint32_t type;     // snakeForceType
+    uint32_t width;
+    uint32_t height;
+    double sigma;
+    uint64_t hash;
+    uint64_t size;     // bytes of tile data after the header
+    uint64_t reserved;
+};
+
+// Hash of the size and the pixels of the w x h float image, taken a
+// 64 bit word at a time.
+uint64_t cacheHash(const float *img, int w, int h);
+
+// Hash of the GVF field (gvf.h) of the image of hash, which also
+// depends on mu and niter.
+uint64_t cacheHashGVF(uint64_t hash, double mu, int niter);
+
+// <dir>/<hash>-<sigma bits>-<f32|f64>.ff, all in hex
+std::string cachePath(
+        const char *dir,
+        uint64_t hash,
+        double sigma,
+        enum snakeForceType type);
+
+// <dir>/<hash>-<sigma bits>-gvf-<mu bits>-<niter>-<f32|f64>.ff for the
+// GVF field, hash being the cacheHashGVF one.
+std::string cachePathGVF(
+        const char *dir,
+        uint64_t hash,
+        double sigma,
+        double mu,
+        int niter,
+        enum snakeForceType type);
+
+// Map the file at path into ff when it holds the field of that key.
+bool cacheLoad(
+        const char *path,
+        uint64_t hash,
+        double sigma,
+        enum snakeForceType type,
+        struct forceField& ff);
+
+// Write the complete (not lazy) field ff under the key.
+bool cacheStore(
+        const char *path,
+        uint64_t hash,
+        double sigma,
+        const struct forceField& ff);
+
+#endif
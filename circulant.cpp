@@ -0,0 +1,150 @@
+#include <cmath>
+#include "circulant.h"
+
+static int nextPow2(int n) {
+    int m = 1;
+    while (m < n)
+        m <<= 1;
+    return m;
+}
+
+// In place iterative radix-2 FFT (forward, unnormalised).
+template <typename T>
+static void fft(std::complex<T> *z, int m, const std::complex<T> *tw) {
+    for (int i = 1, j = 0; i < m; i++) {
+        int bit = m >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j)
+            std::swap(z[i], z[j]);
+    }
+    for (int len = 2; len <= m; len <<= 1) {
+        int half = len >> 1;
+        int step = m / len;
+        for (int i = 0; i < m; i += len) {
+            for (int k = 0; k < half; k++) {
+                std::complex<T> u = z[i + k];
+                std::complex<T> v = z[i + k + half] * tw[k * step];
+                z[i + k] = u + v;
+                z[i + k + half] = u - v;
+            }
+        }
+    }
+}
+
+// Forward DFT of the first n entries of z, work holds m entries.
+template <typename T>
+static void dft(
+        const struct circulant<T>& cf,
+        std::complex<T> *z,
+        std::complex<T> *work) {
+    if (cf.chirp.empty()) {
+        fft(z, cf.m, cf.tw.data());
+        return;
+    }
+    int n = cf.n;
+    int m = cf.m;
+    for (int j = 0; j < n; j++)
+        work[j] = z[j] * cf.chirp[j];
+    for (int j = n; j < m; j++)
+        work[j] = 0;
+    fft(work, m, cf.tw.data());
+    // inverse FFT through conj(FFT(conj(.)))
+    for (int j = 0; j < m; j++)
+        work[j] = std::conj(work[j] * cf.kern[j]);
+    fft(work, m, cf.tw.data());
+    T s = (T) 1 / m;
+    for (int k = 0; k < n; k++)
+        z[k] = std::conj(work[k]) * s * cf.chirp[k];
+}
+
+static void factor(
+        struct circulant<double>& cf,
+        double a,
+        double b,
+        double c,
+        int n) {
+    cf.n = n;
+    cf.m = nextPow2(n);
+    if (cf.m != n)
+        cf.m = nextPow2(2 * n - 1);
+
+    cf.inv.resize(n);
+    for (int k = 0; k < n; k++) {
+        double t = 2 * M_PI * k / n;
+        cf.inv[k] = 1.0 / (a + 2 * b * cos(t) + 2 * c * cos(2 * t));
+    }
+
+    cf.tw.resize(cf.m / 2);
+    for (int k = 0; k < cf.m / 2; k++)
+        cf.tw[k] = std::polar(1.0, -2 * M_PI * k / cf.m);
+
+    cf.chirp.clear();
+    cf.kern.clear();
+    if (cf.m == n)
+        return;
+    // j^2 is reduced mod 2n to keep the angle small for large n
+    cf.chirp.resize(n);
+    for (long j = 0; j < n; j++)
+        cf.chirp[j] = std::polar(1.0, -M_PI * ((j * j) % (2 * n)) / n);
+    cf.kern.assign(cf.m, 0.0);
+    cf.kern[0] = 1.0;
+    for (int j = 1; j < n; j++)
+        cf.kern[j] = cf.kern[cf.m - j] = std::conj(cf.chirp[j]);
+    fft(cf.kern.data(), cf.m, cf.tw.data());
+}
+
+template <typename T>
+void circulantFactor(
+        struct circulant<T>& cf,
+        double a,
+        double b,
+        double c,
+        int n) {
+    struct circulant<double> dc;
+    factor(dc, a, b, c, n);
+    cf.n = dc.n;
+    cf.m = dc.m;
+    cf.inv.assign(dc.inv.begin(), dc.inv.end());
+    cf.tw.assign(dc.tw.begin(), dc.tw.end());
+    cf.chirp.assign(dc.chirp.begin(), dc.chirp.end());
+    cf.kern.assign(dc.kern.begin(), dc.kern.end());
+}
+
+template <typename T>
+void circulantSolve(
+        const struct circulant<T>& cf,
+        T *x,
+        T *y,
+        std::vector<std::complex<T>>& work) {
+    int n = cf.n;
+    work.resize(n + cf.m);
+    std::complex<T> *z = work.data();
+    std::complex<T> *buf = z + n;
+
+    for (int j = 0; j < n; j++)
+        z[j] = std::complex<T>(x[j], y[j]);
+    dft(cf, z, buf);
+    // lambda is real and even, so the inverse DFT is
+    // conj(DFT(conj(.))) / n like above
+    for (int k = 0; k < n; k++)
+        z[k] = std::conj(z[k] * cf.inv[k]);
+    dft(cf, z, buf);
+    T s = (T) 1 / n;
+    for (int j = 0; j < n; j++) {
+        x[j] = z[j].real() * s;
+        y[j] = -z[j].imag() * s;
+    }
+}
+
+template void circulantFactor<float>(
+        struct circulant<float>&, double, double, double, int);
+template void circulantFactor<double>(
+        struct circulant<double>&, double, double, double, int);
+template void circulantSolve<float>(
+        const struct circulant<float>&, float *, float *,
+        std::vector<std::complex<float>>&);
+template void circulantSolve<double>(
+        const struct circulant<double>&, double *, double *,
+        std::vector<std::complex<double>>&);
@@ -0,0 +1,47 @@
+#ifndef CIRCULANT_H
+#define CIRCULANT_H
+
+#include <complex>
+#include <vector>
+
+// Circulant solver
+// ========================================================
+// The snake matrix is circulant, so the DFT diagonalises it and
+// M^-1 is a pointwise multiply by 1 / lambda_k in the frequency
+// domain. The eigenvalues are known in closed form,
+//
+//     lambda_k = a + 2b cos(2 pi k / n) + 2c cos(4 pi k / n),
+//
+// so nothing of size n * n is ever built. Both coordinates are
+// transformed at once as z = x + iy. Sizes that are not a power
+// of two go through Bluestein's chirp-z algorithm.
+//
+// T is the scalar type of the tables and of the solve (float or
+// double); the tables are always computed in double.
+template <typename T>
+struct circulant {
+    int n;
+    int m;                              // FFT size (power of two)
+    std::vector<T> inv;                 // 1 / lambda_k
+    std::vector<std::complex<T>> tw;    // twiddles of the size m FFT
+    std::vector<std::complex<T>> chirp; // empty when m == n
+    std::vector<std::complex<T>> kern;  // FFT of the conjugate chirp
+};
+
+template <typename T>
+void circulantFactor(
+        struct circulant<T>& cf,
+        double a,
+        double b,
+        double c,
+        int n);
+
+// Solve M * u = x and M * v = y in place, work is resized as needed.
+template <typename T>
+void circulantSolve(
+        const struct circulant<T>& cf,
+        T *x,
+        T *y,
+        std::vector<std::complex<T>>& work);
+
+#endif
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#define CL_TARGET_OPENCL_VERSION 120
 #ifdef __APPLE__
   #include <OpenCL/opencl.h>
 #else
@@ -8,25 +10,327 @@
 #endif
 
 #include "util.h"
+#include "snake.h"
+#include "clapi.h"
 
-#define KERNEL_SRC "./kernels/sample.cl"
-
-static char *readFile(const char *filename) {
-    FILE *file = fopen(filename, "rb");
-    if (!file) 
-        DIE("Could not read file: %s", filename);
-    fseek(file, 0, SEEK_END);
-    int len = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    char *buf = malloc(len + 1);
-    if (!buf)
-        DIE("Memory error");
-    fread(buf, 1, len, file);
-    buf[len] = '\0';
-    return buf;
-}
-
-// temporary main function
-int main(int argc, char **argv) {
-    return 0;
+
+#define CL_CHECK(err, what) \
+    do { \
+        if ((err) != CL_SUCCESS) \
+            DIE("OpenCL error %d: %s\n", (int) (err), what); \
+    } while (0)
+
+struct clBatch {
+    cl_context ctx;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel sample;
+    cl_kernel solve;
+    cl_mem field;
+    int width;
+    int height;
+    int tilesX;
+    // snakes
+    int npoints;
+    int nsnakes;
+    cl_mem x;
+    cl_mem y;
+    cl_mem px;
+    cl_mem py;
+    cl_mem owner;
+    cl_mem moving;
+    cl_mem off;
+    cl_mem d;
+    cl_mem e;
+    cl_mem f;
+    cl_mem g;
+    cl_mem h;
+    cl_mem k;
+};
+
+#ifdef KERNEL_SRC
+// Kernels read from the file KERNEL_SRC at run time, NULL (with the
+// reason logged) when it cannot be read.
+static char *kernelSource(void) {
+    FILE *file = fopen(KERNEL_SRC, "rb");
+    if (!file) {
+        ERROR_LOG("Could not read file: %s\n", KERNEL_SRC);
+        return NULL;
+    }
+    char *src = NULL;
+    long len = -1;
+    if (!fseek(file, 0, SEEK_END))
+        len = ftell(file);
+    if (len >= 0 && !fseek(file, 0, SEEK_SET))
+        src = malloc(len + 1);
+    if (src && fread(src, 1, len, file) == (size_t) len) {
+        src[len] = '\0';
+    } else {
+        ERROR_LOG("Could not read file: %s\n", KERNEL_SRC);
+        free(src);
+        src = NULL;
+    }
+    fclose(file);
+    return src;
+}
+#else
+// Kernels built in, kernels/sample.cl.inc is kernels/sample.cl as a
+// string literal (see Makefile).
+static const char kernelText[] =
+#include "kernels/sample.cl.inc"
+    ;
+
+static char *kernelSource(void) {
+    char *src = strdup(kernelText);
+    if (!src)
+        DIE("Memory error\n");
+    return src;
+}
+#endif
+
+static void release(cl_mem *mem) {
+    if (*mem)
+        clReleaseMemObject(*mem);
+    *mem = NULL;
+}
+
+// First device of the first platform that has one.
+static cl_device_id pickDevice(void) {
+    cl_uint nplatforms = 0;
+    if (clGetPlatformIDs(0, NULL, &nplatforms) != CL_SUCCESS || !nplatforms)
+        return NULL;
+    cl_platform_id *platforms = malloc(sizeof(cl_platform_id) * nplatforms);
+    if (!platforms)
+        DIE("Memory error\n");
+    clGetPlatformIDs(nplatforms, platforms, NULL);
+    cl_device_id device = NULL;
+    for (cl_uint i = 0; i < nplatforms && !device; i++) {
+        cl_uint ndevices = 0;
+        if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 1, &device,
+                &ndevices) != CL_SUCCESS || !ndevices)
+            device = NULL;
+    }
+    free(platforms);
+    return device;
+}
+
+static int buildProgram(struct clBatch *cl, cl_device_id device, int tileShift) {
+    char *src = kernelSource();
+    if (!src)
+        return 0;
+    cl_int err;
+    const char *srcs[] = { src };
+    cl->program = clCreateProgramWithSource(cl->ctx, 1, srcs, NULL, &err);
+    free(src);
+    if (err != CL_SUCCESS) {
+        ERROR_LOG("OpenCL error %d: clCreateProgramWithSource\n", err);
+        return 0;
+    }
+    char options[128];
+    snprintf(options, sizeof(options), "-DFORCE_TILE_SHIFT=%d -DNORM_MAX=%d",
+        tileShift, SNAKE_NORM_MAX);
+    if (clBuildProgram(cl->program, 1, &device, options, NULL, NULL)
+            != CL_SUCCESS) {
+        size_t len = 0;
+        clGetProgramBuildInfo(cl->program, device, CL_PROGRAM_BUILD_LOG,
+            0, NULL, &len);
+        char *log = malloc(len + 1);
+        if (!log)
+            DIE("Memory error\n");
+        clGetProgramBuildInfo(cl->program, device, CL_PROGRAM_BUILD_LOG,
+            len, log, NULL);
+        log[len] = '\0';
+        ERROR_LOG("Could not build the kernels:\n%s\n", log);
+        free(log);
+        return 0;
+    }
+    cl->sample = clCreateKernel(cl->program, "sample", &err);
+    if (err == CL_SUCCESS)
+        cl->solve = clCreateKernel(cl->program, "solve", &err);
+    if (err != CL_SUCCESS) {
+        ERROR_LOG("OpenCL error %d: clCreateKernel\n", err);
+        return 0;
+    }
+    return 1;
+}
+
+struct clBatch *clBatchNew(int tileShift) {
+    cl_device_id device = pickDevice();
+    if (!device) {
+        ERROR_LOG("No OpenCL device\n");
+        return NULL;
+    }
+    struct clBatch *cl = calloc(1, sizeof(*cl));
+    if (!cl)
+        DIE("Memory error\n");
+    cl_int err;
+    cl->ctx = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+    if (err == CL_SUCCESS)
+        cl->queue = clCreateCommandQueue(cl->ctx, device, 0, &err);
+    if (err != CL_SUCCESS) {
+        ERROR_LOG("OpenCL error %d: could not set up the device\n", err);
+        clBatchFree(cl);
+        return NULL;
+    }
+    if (!buildProgram(cl, device, tileShift)) {
+        clBatchFree(cl);
+        return NULL;
+    }
+    return cl;
+}
+
+static void releaseSnakes(struct clBatch *cl) {
+    release(&cl->x);
+    release(&cl->y);
+    release(&cl->px);
+    release(&cl->py);
+    release(&cl->owner);
+    release(&cl->moving);
+    release(&cl->off);
+    release(&cl->d);
+    release(&cl->e);
+    release(&cl->f);
+    release(&cl->g);
+    release(&cl->h);
+    release(&cl->k);
+}
+
+void clBatchFree(struct clBatch *cl) {
+    releaseSnakes(cl);
+    release(&cl->field);
+    if (cl->sample)
+        clReleaseKernel(cl->sample);
+    if (cl->solve)
+        clReleaseKernel(cl->solve);
+    if (cl->program)
+        clReleaseProgram(cl->program);
+    if (cl->queue)
+        clReleaseCommandQueue(cl->queue);
+    if (cl->ctx)
+        clReleaseContext(cl->ctx);
+    free(cl);
+}
+
+// Device copy of the size bytes at data.
+static cl_mem upload(
+        struct clBatch *cl,
+        cl_mem_flags flags,
+        const void *data,
+        size_t size) {
+    cl_int err;
+    cl_mem mem = clCreateBuffer(cl->ctx, flags | CL_MEM_COPY_HOST_PTR,
+        size, (void *) data, &err);
+    CL_CHECK(err, "clCreateBuffer");
+    return mem;
+}
+
+static void setArg(cl_kernel kernel, cl_uint i, size_t size, const void *arg) {
+    CL_CHECK(clSetKernelArg(kernel, i, size, arg), "clSetKernelArg");
+}
+
+void clBatchSetField(
+        struct clBatch *cl,
+        const float *tiles,
+        size_t size,
+        int width,
+        int height,
+        int tilesX) {
+    release(&cl->field);
+    cl->field = upload(cl, CL_MEM_READ_ONLY, tiles, sizeof(float) * size);
+    cl->width = width;
+    cl->height = height;
+    cl->tilesX = tilesX;
+    setArg(cl->sample, 0, sizeof(cl_mem), &cl->field);
+    setArg(cl->sample, 1, sizeof(int), &cl->width);
+    setArg(cl->sample, 2, sizeof(int), &cl->height);
+    setArg(cl->sample, 3, sizeof(int), &cl->tilesX);
+}
+
+void clBatchSetSnakes(
+        struct clBatch *cl,
+        const float *x,
+        const float *y,
+        const int *off,
+        int nsnakes,
+        const float *d,
+        const float *e,
+        const float *f,
+        const float *g,
+        const float *h,
+        const int *k,
+        const char *moving) {
+    releaseSnakes(cl);
+    int n = off[nsnakes];
+    size_t size = sizeof(float) * n;
+    int *owner = malloc(sizeof(int) * n);
+    if (!owner)
+        DIE("Memory error\n");
+    for (int s = 0; s < nsnakes; s++)
+        for (int i = off[s]; i < off[s + 1]; i++)
+            owner[i] = s;
+
+    cl->npoints = n;
+    cl->nsnakes = nsnakes;
+    cl->x = upload(cl, CL_MEM_READ_WRITE, x, size);
+    cl->y = upload(cl, CL_MEM_READ_WRITE, y, size);
+    cl->px = upload(cl, CL_MEM_READ_WRITE, x, size);
+    cl->py = upload(cl, CL_MEM_READ_WRITE, y, size);
+    cl->owner = upload(cl, CL_MEM_READ_ONLY, owner, sizeof(int) * n);
+    cl->moving = upload(cl, CL_MEM_READ_WRITE, moving, nsnakes);
+    cl->off = upload(cl, CL_MEM_READ_ONLY, off, sizeof(int) * (nsnakes + 1));
+    cl->d = upload(cl, CL_MEM_READ_ONLY, d, size);
+    cl->e = upload(cl, CL_MEM_READ_ONLY, e, size);
+    cl->f = upload(cl, CL_MEM_READ_ONLY, f, size);
+    cl->g = upload(cl, CL_MEM_READ_ONLY, g, size);
+    cl->h = upload(cl, CL_MEM_READ_ONLY, h, size);
+    cl->k = upload(cl, CL_MEM_READ_ONLY, k, sizeof(int) * nsnakes);
+    free(owner);
+
+    setArg(cl->sample, 4, sizeof(cl_mem), &cl->x);
+    setArg(cl->sample, 5, sizeof(cl_mem), &cl->y);
+    setArg(cl->sample, 6, sizeof(cl_mem), &cl->px);
+    setArg(cl->sample, 7, sizeof(cl_mem), &cl->py);
+    setArg(cl->sample, 8, sizeof(cl_mem), &cl->owner);
+    setArg(cl->sample, 9, sizeof(cl_mem), &cl->moving);
+    setArg(cl->sample, 11, sizeof(int), &cl->npoints);
+    setArg(cl->solve, 0, sizeof(cl_mem), &cl->x);
+    setArg(cl->solve, 1, sizeof(cl_mem), &cl->y);
+    setArg(cl->solve, 2, sizeof(cl_mem), &cl->px);
+    setArg(cl->solve, 3, sizeof(cl_mem), &cl->py);
+    setArg(cl->solve, 4, sizeof(cl_mem), &cl->off);
+    setArg(cl->solve, 5, sizeof(cl_mem), &cl->d);
+    setArg(cl->solve, 6, sizeof(cl_mem), &cl->e);
+    setArg(cl->solve, 7, sizeof(cl_mem), &cl->f);
+    setArg(cl->solve, 8, sizeof(cl_mem), &cl->g);
+    setArg(cl->solve, 9, sizeof(cl_mem), &cl->h);
+    setArg(cl->solve, 10, sizeof(cl_mem), &cl->k);
+    setArg(cl->solve, 11, sizeof(cl_mem), &cl->moving);
+    setArg(cl->solve, 14, sizeof(int), &cl->nsnakes);
+}
+
+void clBatchStep(
+        struct clBatch *cl,
+        float gamma,
+        int norm,
+        float tol,
+        char *moving) {
+    size_t points = cl->npoints;
+    size_t snakes = cl->nsnakes;
+    setArg(cl->sample, 10, sizeof(float), &gamma);
+    setArg(cl->solve, 12, sizeof(int), &norm);
+    setArg(cl->solve, 13, sizeof(float), &tol);
+    CL_CHECK(clEnqueueNDRangeKernel(cl->queue, cl->sample, 1, NULL,
+        &points, NULL, 0, NULL, NULL), "sample");
+    CL_CHECK(clEnqueueNDRangeKernel(cl->queue, cl->solve, 1, NULL,
+        &snakes, NULL, 0, NULL, NULL), "solve");
+    CL_CHECK(clEnqueueReadBuffer(cl->queue, cl->moving, CL_TRUE, 0,
+        snakes, moving, 0, NULL, NULL), "clEnqueueReadBuffer");
+}
+
+void clBatchGetPoints(struct clBatch *cl, float *x, float *y) {
+    size_t size = sizeof(float) * cl->npoints;
+    CL_CHECK(clEnqueueReadBuffer(cl->queue, cl->x, CL_TRUE, 0, size, x,
+        0, NULL, NULL), "clEnqueueReadBuffer");
+    CL_CHECK(clEnqueueReadBuffer(cl->queue, cl->y, CL_TRUE, 0, size, y,
+        0, NULL, NULL), "clEnqueueReadBuffer");
 }
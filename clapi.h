@@ -0,0 +1,61 @@
+#ifndef CLAPI_H
+#define CLAPI_H
+
+#include <stddef.h>
+
+// OpenCL batch backend
+// ========================================================
+// Runs the iterations of a snake batch on an OpenCL device with the
+// kernels of kernels/sample.cl, built into clapi.o (or read at run time
+// from the file KERNEL_SRC when defined): force sampling one work item
+// per point, the
+// banded internal step one per snake. The force field is uploaded
+// once by clBatchSetField and stays on the device until the next
+// one; the snakes are uploaded by clBatchSetSnakes and stay there
+// between iterations, only the moving flags come back every step.
+// Everything is float. Any CPU runtime (PoCL) will do.
+struct clBatch;
+
+// For fields of tiles of 1 << tileShift pixels (FORCE_TILE_SHIFT).
+// NULL (with the reason logged) when there is no OpenCL device or
+// the kernels do not build.
+struct clBatch *clBatchNew(int tileShift);
+void clBatchFree(struct clBatch *cl);
+
+// The size floats of the tiles of a float field (force.h).
+void clBatchSetField(
+        struct clBatch *cl,
+        const float *tiles,
+        size_t size,
+        int width,
+        int height,
+        int tilesX);
+
+// Points of nsnakes snakes back to back, snake s owning
+// [off[s], off[s + 1]), with their banded factors (pentadiag.h) laid
+// out the same way and the moving flag of every snake.
+void clBatchSetSnakes(
+        struct clBatch *cl,
+        const float *x,
+        const float *y,
+        const int *off,
+        int nsnakes,
+        const float *d,
+        const float *e,
+        const float *f,
+        const float *g,
+        const float *h,
+        const int *k,
+        const char *moving);
+
+// One iteration of the moving snakes; moving gets the flags after it.
+void clBatchStep(
+        struct clBatch *cl,
+        float gamma,
+        int norm,
+        float tol,
+        char *moving);
+
+void clBatchGetPoints(struct clBatch *cl, float *x, float *y);
+
+#endif
@@ -38,7 +38,7 @@ void pick_init_points(unsigned int win_height,
     }
 }
 
-xt::xtensor<double, 1> create_circle_conx(float x1, float y1, float x2, float y2)
+xt::xtensor<float, 1> create_circle_conx(float x1, float y1, float x2, float y2)
 {
     float x0 = (x1+x2)/2;
     float y0 = (y1+y2)/2;
@@ -53,7 +53,7 @@ xt::xtensor<double, 1> create_circle_conx(float x1, float y1, float x2, float y2
     return xcon;
 }
 
-xt::xtensor<double, 1> create_circle_cony(float x1, float y1, float x2, float y2)
+xt::xtensor<float, 1> create_circle_cony(float x1, float y1, float x2, float y2)
 {
     float x0 = (x1+x2)/2;
     float y0 = (y1+y2)/2;
@@ -86,8 +86,8 @@ int main(int argc, char **argv)
 
     pick_init_points(img.shape()[0], img.shape()[1], tex_filename, xpoints, ypoints);
 
-    std::vector<xt::xtensor<double, 1>> xcons;
-    std::vector<xt::xtensor<double, 1>> ycons;
+    std::vector<xt::xtensor<float, 1>> xcons;
+    std::vector<xt::xtensor<float, 1>> ycons;
     unsigned int i;
     unsigned int j;
     for (i = 0; i < xpoints.size(); i++) {
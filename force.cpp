@@ -0,0 +1,459 @@
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include "force.h"
+#include "gauss.h"
+
+void forceFieldInit(
+        struct forceField& ff,
+        int width,
+        int height,
+        enum snakeForceType type) {
+    ff.width = width;
+    ff.height = height;
+    ff.tilesX = (width + FORCE_TILE - 1) >> FORCE_TILE_SHIFT;
+    ff.tilesY = (height + FORCE_TILE - 1) >> FORCE_TILE_SHIFT;
+    ff.type = type;
+    size_t size = (size_t) ff.tilesX * ff.tilesY * FORCE_TILE_SIZE;
+    size_t elem = type == SNAKE_FORCE_FLOAT32 ? sizeof(float) : sizeof(double);
+    void *data = calloc(size, elem);
+    if (!data)
+        throw std::bad_alloc();
+    ff.storage.reset(data, free);
+    ff.f32 = type == SNAKE_FORCE_FLOAT32 ? (float *) data : NULL;
+    ff.f64 = type == SNAKE_FORCE_FLOAT64 ? (double *) data : NULL;
+    ff.lazy.reset();
+}
+
+void forceFieldScale(struct forceField& ff, double s) {
+    size_t size = (size_t) ff.tilesX * ff.tilesY * FORCE_TILE_SIZE;
+    for (size_t i = 0; ff.f32 && i < size; i++)
+        ff.f32[i] *= s;
+    for (size_t i = 0; ff.f64 && i < size; i++)
+        ff.f64[i] *= s;
+}
+
+// Lazy fields
+// ========================================================
+struct forceLazy {
+    std::vector<float> img;
+    double sigma;
+    int halo;
+    int block;   // block side in pixels, a multiple of FORCE_TILE
+    int blocksX;
+    int blocksY;
+    std::unique_ptr<std::once_flag[]> once;
+    std::unique_ptr<std::atomic<bool>[]> ready;
+};
+
+void forceFieldInitLazy(
+        struct forceField& ff,
+        std::vector<float> img,
+        int width,
+        int height,
+        double sigma,
+        enum snakeForceType type) {
+    forceFieldInit(ff, width, height, type);
+    std::shared_ptr<struct forceLazy> lz = std::make_shared<forceLazy>();
+    lz->img = std::move(img);
+    lz->sigma = sigma;
+    // 6 sigma of the outer Gaussian (the recursive one has a longer
+    // tail than the real one), 4 of the inner one at sigma 1 and a
+    // pixel for each of the two differences. Blocks are 4 halos wide,
+    // so a crop costs at most 2.25 times its block.
+    lz->halo = (int) ceil(6 * sigma) + 6;
+    int tiles = (4 * lz->halo + FORCE_TILE - 1) >> FORCE_TILE_SHIFT;
+    lz->block = std::max(tiles, 1) << FORCE_TILE_SHIFT;
+    lz->blocksX = (width + lz->block - 1) / lz->block;
+    lz->blocksY = (height + lz->block - 1) / lz->block;
+    int nblocks = lz->blocksX * lz->blocksY;
+    lz->once.reset(new std::once_flag[nblocks]);
+    lz->ready.reset(new std::atomic<bool>[nblocks]);
+    for (int i = 0; i < nblocks; i++)
+        lz->ready[i].store(false, std::memory_order_relaxed);
+    ff.lazy = lz;
+}
+
+template <typename T>
+static void forceCopyBlock(
+        const struct forceField& ff,
+        T *data,
+        const struct forceField& crop,
+        const T *cdata,
+        int x0,
+        int y0,
+        int cx,
+        int cy,
+        int w,
+        int h) {
+    for (int y = y0; y < y0 + h; y++) {
+        for (int x = x0; x < x0 + w; x++) {
+            T *d = data + forceIndex(ff, x, y);
+            const T *c = cdata + forceIndex(crop, x - cx, y - cy);
+            d[0] = c[0];
+            d[1] = c[1];
+        }
+    }
+}
+
+static void forceComputeBlock(const struct forceField& ff, int b) {
+    struct forceLazy& lz = *ff.lazy;
+    int x0 = (b % lz.blocksX) * lz.block;
+    int y0 = (b / lz.blocksX) * lz.block;
+    int w = std::min(lz.block, ff.width - x0);
+    int h = std::min(lz.block, ff.height - y0);
+    int cx = std::max(x0 - lz.halo, 0);
+    int cy = std::max(y0 - lz.halo, 0);
+    int cw = std::min(x0 + w + lz.halo, ff.width) - cx;
+    int ch = std::min(y0 + h + lz.halo, ff.height) - cy;
+
+    std::vector<float> img((size_t) cw * ch);
+    for (int y = 0; y < ch; y++) {
+        const float *row = lz.img.data() + (size_t) (cy + y) * ff.width + cx;
+        std::copy(row, row + cw, img.begin() + (size_t) y * cw);
+    }
+    struct forceField crop;
+    forceFieldInit(crop, cw, ch, ff.type);
+    gaussForce(img.data(), cw, ch, lz.sigma, crop, NULL);
+    if (ff.type == SNAKE_FORCE_FLOAT32)
+        forceCopyBlock(ff, ff.f32, crop, crop.f32, x0, y0, cx, cy, w, h);
+    else
+        forceCopyBlock(ff, ff.f64, crop, crop.f64, x0, y0, cx, cy, w, h);
+}
+
+static void forceEnsureBlock(const struct forceField& ff, int b) {
+    struct forceLazy& lz = *ff.lazy;
+    if (lz.ready[b].load(std::memory_order_acquire))
+        return;
+    std::call_once(lz.once[b], [&ff, b]() {
+        forceComputeBlock(ff, b);
+        ff.lazy->ready[b].store(true, std::memory_order_release);
+    });
+}
+
+template <typename C>
+void forceFieldPrepare(
+        const struct forceField& ff,
+        const C *x,
+        const C *y,
+        int n) {
+    if (!ff.lazy)
+        return;
+    const struct forceLazy& lz = *ff.lazy;
+    C xmax = ff.width - 1;
+    C ymax = ff.height - 1;
+    int last = -1;
+    for (int i = 0; i < n; i++) {
+        C xc = std::fmin(std::fmax(x[i], (C) 0), xmax);
+        C yc = std::fmin(std::fmax(y[i], (C) 0), ymax);
+        int x0 = std::min((int) xc, ff.width - 2);
+        int y0 = std::min((int) yc, ff.height - 2);
+        int bx = x0 / lz.block;
+        int by = y0 / lz.block;
+        int b = by * lz.blocksX + bx;
+        if (b != last)
+            forceEnsureBlock(ff, b);
+        last = b;
+        // the other corners only leave the block on its last row/column
+        int dx = (x0 + 1) / lz.block - bx;
+        int dy = (y0 + 1) / lz.block - by;
+        if (dx)
+            forceEnsureBlock(ff, b + 1);
+        if (dy)
+            forceEnsureBlock(ff, b + lz.blocksX);
+        if (dx && dy)
+            forceEnsureBlock(ff, b + lz.blocksX + 1);
+    }
+}
+
+template void forceFieldPrepare<float>(
+        const struct forceField&, const float *, const float *, int);
+template void forceFieldPrepare<double>(
+        const struct forceField&, const double *, const double *, int);
+
+#if defined(__x86_64__) || defined(__i386__)
+// GCC 12 flags the undefined pass-through operand of every masked
+// AVX-512 builtin as maybe uninitialized once inlined (GCC bug 105593);
+// the warning points into the header, so silence it for the header.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+#define FORCE_X86 1
+#endif
+
+template <typename C>
+using forceSampleFn = void (*)(
+        const struct forceField&,
+        const C *,
+        const C *,
+        int,
+        C *,
+        C *);
+
+#ifdef FORCE_X86
+// AVX2 kernel
+// ========================================================
+// 8 points per step. Coordinates go down to float lanes, are clamped
+// and truncated without any branch, then the tiled index of the four
+// corners is computed (forceIndex), fx and fy of every corner are
+// fetched with gathers and blended with two FMAs each.
+__attribute__((target("avx2,fma")))
+static inline __m256 lerp8(__m256 a, __m256 b, __m256 t) {
+    return _mm256_fmadd_ps(t, _mm256_sub_ps(b, a), a);
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256i index8(__m256i x, __m256i y, __m256i tilesX) {
+    const __m256i mask = _mm256_set1_epi32(FORCE_TILE_MASK);
+    __m256i tile = _mm256_add_epi32(
+        _mm256_mullo_epi32(_mm256_srli_epi32(y, FORCE_TILE_SHIFT), tilesX),
+        _mm256_srli_epi32(x, FORCE_TILE_SHIFT));
+    __m256i in = _mm256_add_epi32(
+        _mm256_slli_epi32(_mm256_and_si256(y, mask), FORCE_TILE_SHIFT),
+        _mm256_and_si256(x, mask));
+    return _mm256_add_epi32(
+        _mm256_slli_epi32(tile, 2 * FORCE_TILE_SHIFT + 1),
+        _mm256_slli_epi32(in, 1));
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 load8(const double *p) {
+    return _mm256_set_m128(
+        _mm256_cvtpd_ps(_mm256_loadu_pd(p + 4)),
+        _mm256_cvtpd_ps(_mm256_loadu_pd(p)));
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 load8(const float *p) {
+    return _mm256_loadu_ps(p);
+}
+
+__attribute__((target("avx2,fma")))
+static inline void store8(double *p, __m256 v) {
+    _mm256_storeu_pd(p, _mm256_cvtps_pd(_mm256_castps256_ps128(v)));
+    _mm256_storeu_pd(p + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+}
+
+__attribute__((target("avx2,fma")))
+static inline void store8(float *p, __m256 v) {
+    _mm256_storeu_ps(p, v);
+}
+
+template <typename C>
+__attribute__((target("avx2,fma")))
+static void forceSampleAvx2(
+        const struct forceField& ff,
+        const C *x,
+        const C *y,
+        int n,
+        C *fx,
+        C *fy) {
+    const float *px = ff.f32;
+    const float *py = px + 1;
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 xmax = _mm256_set1_ps(ff.width - 1);
+    const __m256 ymax = _mm256_set1_ps(ff.height - 1);
+    const __m256i x0max = _mm256_set1_epi32(ff.width - 2);
+    const __m256i y0max = _mm256_set1_epi32(ff.height - 2);
+    const __m256i tilesX = _mm256_set1_epi32(ff.tilesX);
+    const __m256i one = _mm256_set1_epi32(1);
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 xs = load8(x + i);
+        __m256 ys = load8(y + i);
+        xs = _mm256_min_ps(_mm256_max_ps(xs, zero), xmax);
+        ys = _mm256_min_ps(_mm256_max_ps(ys, zero), ymax);
+        __m256i x0 = _mm256_min_epi32(_mm256_cvttps_epi32(xs), x0max);
+        __m256i y0 = _mm256_min_epi32(_mm256_cvttps_epi32(ys), y0max);
+        __m256 tx = _mm256_sub_ps(xs, _mm256_cvtepi32_ps(x0));
+        __m256 ty = _mm256_sub_ps(ys, _mm256_cvtepi32_ps(y0));
+
+        __m256i x1 = _mm256_add_epi32(x0, one);
+        __m256i y1 = _mm256_add_epi32(y0, one);
+        __m256i k00 = index8(x0, y0, tilesX);
+        __m256i k01 = index8(x1, y0, tilesX);
+        __m256i k10 = index8(x0, y1, tilesX);
+        __m256i k11 = index8(x1, y1, tilesX);
+
+        __m256 ax = lerp8(
+            _mm256_i32gather_ps(px, k00, 4),
+            _mm256_i32gather_ps(px, k01, 4), tx);
+        __m256 bx = lerp8(
+            _mm256_i32gather_ps(px, k10, 4),
+            _mm256_i32gather_ps(px, k11, 4), tx);
+        __m256 ay = lerp8(
+            _mm256_i32gather_ps(py, k00, 4),
+            _mm256_i32gather_ps(py, k01, 4), tx);
+        __m256 by = lerp8(
+            _mm256_i32gather_ps(py, k10, 4),
+            _mm256_i32gather_ps(py, k11, 4), tx);
+        __m256 rx = lerp8(ax, bx, ty);
+        __m256 ry = lerp8(ay, by, ty);
+
+        store8(fx + i, rx);
+        store8(fy + i, ry);
+    }
+    forceSample(ff, x + i, y + i, n - i, fx + i, fy + i);
+}
+
+// AVX-512 kernel
+// ========================================================
+// Same as the AVX2 kernel with 16 points per step.
+__attribute__((target("avx512f,avx512dq")))
+static inline __m512 lerp16(__m512 a, __m512 b, __m512 t) {
+    return _mm512_fmadd_ps(t, _mm512_sub_ps(b, a), a);
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static inline __m512i index16(__m512i x, __m512i y, __m512i tilesX) {
+    const __m512i mask = _mm512_set1_epi32(FORCE_TILE_MASK);
+    __m512i tile = _mm512_add_epi32(
+        _mm512_mullo_epi32(_mm512_srli_epi32(y, FORCE_TILE_SHIFT), tilesX),
+        _mm512_srli_epi32(x, FORCE_TILE_SHIFT));
+    __m512i in = _mm512_add_epi32(
+        _mm512_slli_epi32(_mm512_and_si512(y, mask), FORCE_TILE_SHIFT),
+        _mm512_and_si512(x, mask));
+    return _mm512_add_epi32(
+        _mm512_slli_epi32(tile, 2 * FORCE_TILE_SHIFT + 1),
+        _mm512_slli_epi32(in, 1));
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static inline __m512 load16(const double *p) {
+    return _mm512_insertf32x8(
+        _mm512_castps256_ps512(_mm512_cvtpd_ps(_mm512_loadu_pd(p))),
+        _mm512_cvtpd_ps(_mm512_loadu_pd(p + 8)), 1);
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static inline __m512 load16(const float *p) {
+    return _mm512_loadu_ps(p);
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static inline void store16(double *p, __m512 v) {
+    _mm512_storeu_pd(p, _mm512_cvtps_pd(_mm512_castps512_ps256(v)));
+    _mm512_storeu_pd(p + 8, _mm512_cvtps_pd(_mm512_extractf32x8_ps(v, 1)));
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static inline void store16(float *p, __m512 v) {
+    _mm512_storeu_ps(p, v);
+}
+
+template <typename C>
+__attribute__((target("avx512f,avx512dq")))
+static void forceSampleAvx512(
+        const struct forceField& ff,
+        const C *x,
+        const C *y,
+        int n,
+        C *fx,
+        C *fy) {
+    const float *px = ff.f32;
+    const float *py = px + 1;
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 xmax = _mm512_set1_ps(ff.width - 1);
+    const __m512 ymax = _mm512_set1_ps(ff.height - 1);
+    const __m512i x0max = _mm512_set1_epi32(ff.width - 2);
+    const __m512i y0max = _mm512_set1_epi32(ff.height - 2);
+    const __m512i tilesX = _mm512_set1_epi32(ff.tilesX);
+    const __m512i one = _mm512_set1_epi32(1);
+
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 xs = load16(x + i);
+        __m512 ys = load16(y + i);
+        xs = _mm512_min_ps(_mm512_max_ps(xs, zero), xmax);
+        ys = _mm512_min_ps(_mm512_max_ps(ys, zero), ymax);
+        __m512i x0 = _mm512_min_epi32(_mm512_cvttps_epi32(xs), x0max);
+        __m512i y0 = _mm512_min_epi32(_mm512_cvttps_epi32(ys), y0max);
+        __m512 tx = _mm512_sub_ps(xs, _mm512_cvtepi32_ps(x0));
+        __m512 ty = _mm512_sub_ps(ys, _mm512_cvtepi32_ps(y0));
+
+        __m512i x1 = _mm512_add_epi32(x0, one);
+        __m512i y1 = _mm512_add_epi32(y0, one);
+        __m512i k00 = index16(x0, y0, tilesX);
+        __m512i k01 = index16(x1, y0, tilesX);
+        __m512i k10 = index16(x0, y1, tilesX);
+        __m512i k11 = index16(x1, y1, tilesX);
+
+        __m512 ax = lerp16(
+            _mm512_i32gather_ps(k00, px, 4),
+            _mm512_i32gather_ps(k01, px, 4), tx);
+        __m512 bx = lerp16(
+            _mm512_i32gather_ps(k10, px, 4),
+            _mm512_i32gather_ps(k11, px, 4), tx);
+        __m512 ay = lerp16(
+            _mm512_i32gather_ps(k00, py, 4),
+            _mm512_i32gather_ps(k01, py, 4), tx);
+        __m512 by = lerp16(
+            _mm512_i32gather_ps(k10, py, 4),
+            _mm512_i32gather_ps(k11, py, 4), tx);
+        __m512 rx = lerp16(ax, bx, ty);
+        __m512 ry = lerp16(ay, by, ty);
+
+        store16(fx + i, rx);
+        store16(fy + i, ry);
+    }
+    forceSample(ff, x + i, y + i, n - i, fx + i, fy + i);
+}
+#endif
+
+template <typename C>
+static void forceSampleScalar(
+        const struct forceField& ff,
+        const C *x,
+        const C *y,
+        int n,
+        C *fx,
+        C *fy) {
+    forceSample(ff, x, y, n, fx, fy);
+}
+
+template <typename C>
+static forceSampleFn<C> forceSelect() {
+#ifdef FORCE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+        return forceSampleAvx512<C>;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return forceSampleAvx2<C>;
+#endif
+    return forceSampleScalar<C>;
+}
+
+static const forceSampleFn<double> forceSampleImpl = forceSelect<double>();
+static const forceSampleFn<float> forceSampleImplF = forceSelect<float>();
+
+void forceSampleSimd(
+        const struct forceField& ff,
+        const double *x,
+        const double *y,
+        int n,
+        double *fx,
+        double *fy) {
+    forceFieldPrepare(ff, x, y, n);
+    if (ff.type == SNAKE_FORCE_FLOAT32)
+        forceSampleImpl(ff, x, y, n, fx, fy);
+    else
+        forceSample(ff, x, y, n, fx, fy);
+}
+
+void forceSampleSimd(
+        const struct forceField& ff,
+        const float *x,
+        const float *y,
+        int n,
+        float *fx,
+        float *fy) {
+    forceFieldPrepare(ff, x, y, n);
+    if (ff.type == SNAKE_FORCE_FLOAT32)
+        forceSampleImplF(ff, x, y, n, fx, fy);
+    else
+        forceSample(ff, x, y, n, fx, fy);
+}
@@ -0,0 +1,172 @@
+#ifndef FORCE_H
+#define FORCE_H
+
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "snake.h"
+
+// External force field
+// ========================================================
+// The image is cut in FORCE_TILE x FORCE_TILE tiles, stored row after
+// row of tiles; inside a tile the pixels are row major and every pixel
+// holds its (fx, fy) pair next to each other. The four corners of a
+// bilinear lookup then usually share one tile and a couple of cache
+// lines, and a snake walking along the image stays in a few tiles.
+// Tiles on the right and bottom edge are padded to the full size.
+//
+// Values are float (SNAKE_FORCE_FLOAT32, half the memory traffic) or
+// double (SNAKE_FORCE_FLOAT64); only the pointer of the field's type
+// is set. storage owns the tiles. Sampling is bilinear with
+// coordinates clamped to the image, which needs width, height >= 2.
+#define FORCE_TILE_SHIFT 5
+#define FORCE_TILE (1 << FORCE_TILE_SHIFT)
+#define FORCE_TILE_MASK (FORCE_TILE - 1)
+#define FORCE_TILE_SIZE (2 * FORCE_TILE * FORCE_TILE)
+
+struct forceLazy;
+
+struct forceField {
+    int width;
+    int height;
+    int tilesX;
+    int tilesY;
+    enum snakeForceType type;
+    float *f32;
+    double *f64;
+    std::shared_ptr<void> storage;
+    std::shared_ptr<struct forceLazy> lazy;
+};
+
+// Allocate zeroed tiles. Pages nobody writes are never backed by
+// memory, which is what lazy fields rely on.
+void forceFieldInit(
+        struct forceField& ff,
+        int width,
+        int height,
+        enum snakeForceType type);
+
+// Lazy fields
+// ========================================================
+// A lazy field keeps the w x h float image and computes the force
+// (gaussForce at sigma) block by block, the first time a point of the
+// block is sampled. A block is a square of whole tiles four halos
+// wide; it is computed on a crop grown by the halo (the
+// support of the Gaussians and differences) and only its own pixels
+// are kept. Blocks are computed once even when several threads sample
+// them at the same time, by the first of them.
+void forceFieldInitLazy(
+        struct forceField& ff,
+        std::vector<float> img,
+        int width,
+        int height,
+        double sigma,
+        enum snakeForceType type);
+
+// Compute the missing blocks the n points (x[i], y[i]) sample from.
+// forceSampleSimd does this itself, forceSample expects it done.
+// Points are float or double, like in every sampling function.
+template <typename C>
+void forceFieldPrepare(
+        const struct forceField& ff,
+        const C *x,
+        const C *y,
+        int n);
+
+// Multiply every value by s.
+void forceFieldScale(struct forceField& ff, double s);
+
+// Index of fx of pixel (x, y), fy follows it.
+inline size_t forceIndex(const struct forceField& ff, int x, int y) {
+    size_t tile = (size_t) (y >> FORCE_TILE_SHIFT) * ff.tilesX
+        + (x >> FORCE_TILE_SHIFT);
+    return tile * FORCE_TILE_SIZE
+        + (((y & FORCE_TILE_MASK) << FORCE_TILE_SHIFT)
+        + (x & FORCE_TILE_MASK)) * 2;
+}
+
+inline void forceFieldSet(
+        struct forceField& ff,
+        int x,
+        int y,
+        double fx,
+        double fy) {
+    size_t k = forceIndex(ff, x, y);
+    if (ff.type == SNAKE_FORCE_FLOAT32) {
+        ff.f32[k] = fx;
+        ff.f32[k + 1] = fy;
+    } else {
+        ff.f64[k] = fx;
+        ff.f64[k + 1] = fy;
+    }
+}
+
+template <typename T, typename C>
+inline void forceSampleT(
+        const struct forceField& ff,
+        const T *data,
+        const C *x,
+        const C *y,
+        int n,
+        C *fx,
+        C *fy) {
+    C xmax = ff.width - 1;
+    C ymax = ff.height - 1;
+    // fmax drops NaN, the points of a diverged snake sample pixel 0
+    for (int i = 0; i < n; i++) {
+        C xc = std::fmin(std::fmax(x[i], (C) 0), xmax);
+        C yc = std::fmin(std::fmax(y[i], (C) 0), ymax);
+        int x0 = std::min((int) xc, ff.width - 2);
+        int y0 = std::min((int) yc, ff.height - 2);
+        C tx = xc - x0;
+        C ty = yc - y0;
+        const T *p00 = data + forceIndex(ff, x0, y0);
+        const T *p01 = data + forceIndex(ff, x0 + 1, y0);
+        const T *p10 = data + forceIndex(ff, x0, y0 + 1);
+        const T *p11 = data + forceIndex(ff, x0 + 1, y0 + 1);
+
+        C ax = p00[0] + tx * (p01[0] - p00[0]);
+        C bx = p10[0] + tx * (p11[0] - p10[0]);
+        C ay = p00[1] + tx * (p01[1] - p00[1]);
+        C by = p10[1] + tx * (p11[1] - p10[1]);
+        fx[i] = ax + ty * (bx - ax);
+        fy[i] = ay + ty * (by - ay);
+    }
+}
+
+// Sample fx and fy at the n points (x[i], y[i]), scalar version.
+template <typename C>
+inline void forceSample(
+        const struct forceField& ff,
+        const C *x,
+        const C *y,
+        int n,
+        C *fx,
+        C *fy) {
+    if (ff.type == SNAKE_FORCE_FLOAT32)
+        forceSampleT(ff, ff.f32, x, y, n, fx, fy);
+    else
+        forceSampleT(ff, ff.f64, x, y, n, fx, fy);
+}
+
+// Same as forceSample, dispatched once at startup to an AVX-512
+// (16 points) or AVX2 (8 points) gather kernel when the CPU has it.
+// The kernels are float only, double fields use forceSample. Float
+// points skip the conversions in and out of the kernels.
+void forceSampleSimd(
+        const struct forceField& ff,
+        const double *x,
+        const double *y,
+        int n,
+        double *fx,
+        double *fy);
+void forceSampleSimd(
+        const struct forceField& ff,
+        const float *x,
+        const float *y,
+        int n,
+        float *fx,
+        float *fy);
+
+#endif
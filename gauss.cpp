@@ -0,0 +1,274 @@
+#include <cmath>
+#include <algorithm>
+#include "gauss.h"
+#include "force.h"
+extern "C" {
+#include "pool/pool.h"
+}
+
+void gaussInit(struct gauss& g, double sigma) {
+    sigma = std::max(sigma, 0.5);
+    double q = sigma >= 2.5
+        ? 0.98711 * sigma - 0.96330
+        : 3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+    double q2 = q * q;
+    double q3 = q2 * q;
+    double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+    double a1 = g.a1 = (2.44413 * q + 2.85619 * q2 + 1.26661 * q3) / b0;
+    double a2 = g.a2 = -(1.4281 * q2 + 1.26661 * q3) / b0;
+    double a3 = g.a3 = 0.422205 * q3 / b0;
+    g.b = 1 - (a1 + a2 + a3);
+
+    double s = 1 / ((1 + a1 - a2 + a3) * (1 - a1 - a2 - a3)
+        * (1 + a2 + (a1 - a3) * a3));
+    g.m[0][0] = s * (-a3 * a1 + 1 - a3 * a3 - a2);
+    g.m[0][1] = s * (a3 + a1) * (a2 + a3 * a1);
+    g.m[0][2] = s * a3 * (a1 + a3 * a2);
+    g.m[1][0] = s * (a1 + a3 * a2);
+    g.m[1][1] = -s * (a2 - 1) * (a2 + a3 * a1);
+    g.m[1][2] = -s * a3 * (a3 * a1 + a3 * a3 + a2 - 1);
+    g.m[2][0] = s * (a3 * a1 + a2 + a1 * a1 - a2 * a2);
+    g.m[2][1] = s * (a1 * a2 + a3 * a2 * a2 - a1 * a3 * a3
+        - a3 * a3 * a3 - a3 * a2 + a3);
+    g.m[2][2] = s * a3 * (a1 + a3 * a2);
+}
+
+// Filter count lines of n samples at once, sample i of line j sits at
+// x[i * step + j * lstride]. The lines are interleaved in work (n + 2
+// rows of count), so a block of columns runs with unit stride.
+static void gaussLines(
+        const struct gauss& g,
+        float *x,
+        int n,
+        long step,
+        int count,
+        long lstride,
+        std::vector<double>& work) {
+    work.resize((size_t) (n + 2) * count);
+    double *w = work.data();
+
+    // causal pass, a constant line x[0] before the start
+    for (int i = 0; i < n; i++) {
+        const float *xi = x + i * step;
+        double *wi = w + (size_t) i * count;
+        if (i < 3) {
+            for (int j = 0; j < count; j++) {
+                double x0 = x[j * lstride];
+                double w1 = i >= 1 ? wi[j - count] : x0;
+                double w2 = i >= 2 ? wi[j - 2 * count] : x0;
+                wi[j] = g.b * xi[j * lstride] + g.a1 * w1 + g.a2 * w2
+                    + g.a3 * x0;
+            }
+            continue;
+        }
+        for (int j = 0; j < count; j++)
+            wi[j] = g.b * xi[j * lstride] + g.a1 * wi[j - count]
+                + g.a2 * wi[j - 2 * count] + g.a3 * wi[j - 3 * count];
+    }
+
+    // anti-causal pass from the Triggs - Sdika state of a constant
+    // line x[n - 1] after the end, rows n - 1, n, n + 1
+    const double *u0 = w + (size_t) (n - 1) * count;
+    const double *u1 = w + (size_t) std::max(n - 2, 0) * count;
+    const double *u2 = w + (size_t) std::max(n - 3, 0) * count;
+    for (int j = 0; j < count; j++) {
+        double ip = x[(n - 1) * step + j * lstride];
+        double d0 = u0[j] - ip;
+        double d1 = u1[j] - ip;
+        double d2 = u2[j] - ip;
+        double y[3];
+        for (int k = 0; k < 3; k++)
+            y[k] = g.b * (g.m[k][0] * d0 + g.m[k][1] * d1 + g.m[k][2] * d2)
+                + ip;
+        for (int k = 0; k < 3; k++)
+            w[(size_t) (n - 1 + k) * count + j] = y[k];
+    }
+    for (int i = n - 2; i >= 0; i--) {
+        double *wi = w + (size_t) i * count;
+        for (int j = 0; j < count; j++)
+            wi[j] = g.b * wi[j] + g.a1 * wi[j + count]
+                + g.a2 * wi[j + 2 * count] + g.a3 * wi[j + 3 * count];
+    }
+
+    for (int i = 0; i < n; i++) {
+        float *xi = x + i * step;
+        const double *wi = w + (size_t) i * count;
+        for (int j = 0; j < count; j++)
+            xi[j * lstride] = wi[j];
+    }
+}
+
+void gaussLine(
+        const struct gauss& g,
+        float *x,
+        int n,
+        long stride,
+        std::vector<double>& work) {
+    gaussLines(g, x, n, stride, 1, 0, work);
+}
+
+// Pipeline stages
+// ========================================================
+// Every stage runs over bands of rows or blocks of columns, stages
+// are separated by waiting on all bands.
+//
+// 1. rows:      s = img smoothed along x
+// 2. columns:   s smoothed along y
+// 3. rows:      gm = |central differences of s|, smoothed along x
+// 4. columns:   gm smoothed along y
+// 5. rows:      (fx, fy) = central differences of gm, into the field
+
+/// Rows per band and columns per block.
+#define GAUSS_ROWS 16
+#define GAUSS_COLS 16
+
+struct gaussJob {
+    const float *img;
+    int w;
+    int h;
+    float *s;
+    float *gm;
+    struct forceField *ff;
+    struct gauss outer;
+    struct gauss inner;
+};
+
+struct gaussBand {
+    struct gaussJob *job;
+    int begin;
+    int end;
+    std::vector<double> work;
+};
+
+// Central difference of the n samples x[0], x[stride], ... at i,
+// one sided at the ends.
+static inline float centralDiff(const float *x, int i, int n, long stride) {
+    int lo = std::max(i - 1, 0);
+    int hi = std::min(i + 1, n - 1);
+    return (x[hi * stride] - x[lo * stride]) / (hi - lo);
+}
+
+static void smoothRowsTask(void *arg) {
+    struct gaussBand *b = (struct gaussBand *) arg;
+    struct gaussJob *j = b->job;
+    for (int y = b->begin; y < b->end; y++) {
+        const float *row = j->img + (size_t) y * j->w;
+        float *s = j->s + (size_t) y * j->w;
+        std::copy(row, row + j->w, s);
+        gaussLine(j->outer, s, j->w, 1, b->work);
+    }
+}
+
+static void smoothColumnsTask(void *arg) {
+    struct gaussBand *b = (struct gaussBand *) arg;
+    struct gaussJob *j = b->job;
+    gaussLines(j->outer, j->s + b->begin, j->h, j->w,
+        b->end - b->begin, 1, b->work);
+}
+
+static void magnitudeRowsTask(void *arg) {
+    struct gaussBand *b = (struct gaussBand *) arg;
+    struct gaussJob *j = b->job;
+    for (int y = b->begin; y < b->end; y++) {
+        const float *s = j->s + (size_t) y * j->w;
+        float *gm = j->gm + (size_t) y * j->w;
+        for (int x = 0; x < j->w; x++) {
+            float dx = centralDiff(s, x, j->w, 1);
+            float dy = centralDiff(s - (size_t) y * j->w + x, y, j->h, j->w);
+            gm[x] = sqrtf(dx * dx + dy * dy);
+        }
+        gaussLine(j->inner, gm, j->w, 1, b->work);
+    }
+}
+
+static void magnitudeColumnsTask(void *arg) {
+    struct gaussBand *b = (struct gaussBand *) arg;
+    struct gaussJob *j = b->job;
+    gaussLines(j->inner, j->gm + b->begin, j->h, j->w,
+        b->end - b->begin, 1, b->work);
+}
+
+template <typename T>
+static void gradientRows(struct gaussBand *b, T *data) {
+    struct gaussJob *j = b->job;
+    for (int y = b->begin; y < b->end; y++) {
+        const float *gm = j->gm + (size_t) y * j->w;
+        for (int x = 0; x < j->w; x++) {
+            T *f = data + forceIndex(*j->ff, x, y);
+            f[0] = centralDiff(gm, x, j->w, 1);
+            f[1] = centralDiff(gm - (size_t) y * j->w + x, y, j->h, j->w);
+        }
+    }
+}
+
+static void gradientRowsTask(void *arg) {
+    struct gaussBand *b = (struct gaussBand *) arg;
+    struct forceField *ff = b->job->ff;
+    if (ff->type == SNAKE_FORCE_FLOAT32)
+        gradientRows(b, ff->f32);
+    else
+        gradientRows(b, ff->f64);
+}
+
+static void gaussBands(
+        struct gaussJob& job,
+        int n,
+        int size,
+        std::vector<struct gaussBand>& bands) {
+    for (int i = 0; i < n; i += size) {
+        bands.emplace_back();
+        bands.back().job = &job;
+        bands.back().begin = i;
+        bands.back().end = std::min(i + size, n);
+    }
+}
+
+static void gaussRun(
+        struct pool *p,
+        std::vector<struct gaussBand>& bands,
+        taskFn fn) {
+    if (!p) {
+        for (struct gaussBand& b : bands)
+            fn(&b);
+        return;
+    }
+    struct waitGroup wg;
+    waitGroupInit(&wg);
+    for (struct gaussBand& b : bands) {
+        struct task t = { fn, &b, &wg };
+        poolAddTask(p, t);
+    }
+    waitGroupWait(&wg);
+    waitGroupFree(&wg);
+}
+
+void gaussForce(
+        const float *img,
+        int w,
+        int h,
+        double sigma,
+        struct forceField& ff,
+        struct pool *p) {
+    std::vector<float> s((size_t) w * h);
+    std::vector<float> gm((size_t) w * h);
+    struct gaussJob job;
+    job.img = img;
+    job.w = w;
+    job.h = h;
+    job.s = s.data();
+    job.gm = gm.data();
+    job.ff = &ff;
+    gaussInit(job.outer, sigma);
+    gaussInit(job.inner, 1.0);
+
+    std::vector<struct gaussBand> rows;
+    std::vector<struct gaussBand> columns;
+    gaussBands(job, h, GAUSS_ROWS, rows);
+    gaussBands(job, w, GAUSS_COLS, columns);
+
+    gaussRun(p, rows, smoothRowsTask);
+    gaussRun(p, columns, smoothColumnsTask);
+    gaussRun(p, rows, magnitudeRowsTask);
+    gaussRun(p, columns, magnitudeColumnsTask);
+    gaussRun(p, rows, gradientRowsTask);
+}
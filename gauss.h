@@ -0,0 +1,59 @@
+#ifndef GAUSS_H
+#define GAUSS_H
+
+#include <vector>
+
+struct pool;
+struct forceField;
+
+// Recursive Gaussian
+// ========================================================
+// Young - van Vliet third order IIR approximation of a Gaussian: a
+// causal and an anti-causal pass of
+//
+//   w[n] = B x[n] + a1 w[n-1] + a2 w[n-2] + a3 w[n-3]
+//
+// per line, so the cost per pixel does not depend on sigma. Lines are
+// extended by replicating their end points; the anti-causal pass
+// starts from the exact Triggs - Sdika state for that. Good from
+// sigma = 0.5 (smaller sigmas are clamped to it).
+struct gauss {
+    double b;
+    double a1;
+    double a2;
+    double a3;
+    double m[3][3]; // Triggs - Sdika boundary matrix
+};
+
+void gaussInit(struct gauss& g, double sigma);
+
+// Filter the n samples x[0], x[stride], ... in place, work holds n.
+void gaussLine(
+        const struct gauss& g,
+        float *x,
+        int n,
+        long stride,
+        std::vector<double>& work);
+
+// Gradient force pipeline
+// ========================================================
+// Fused, recursive version of
+//
+//   gm = GradientMagnitude(img, sigma)
+//   (fx, fy) = Gradient(gm, 1)
+//
+// on the w x h float image (row major, x fastest): Gaussian smoothing
+// followed by central differences, for both derivatives. Needs
+// w, h >= 2. Rows and column blocks of every stage are spread over
+// the workers of p (running, or NULL to run on the calling thread).
+// The force goes straight into ff, set up for w x h (forceFieldInit);
+// on the way two w x h float planes are used.
+void gaussForce(
+        const float *img,
+        int w,
+        int h,
+        double sigma,
+        struct forceField& ff,
+        struct pool *p);
+
+#endif
@@ -0,0 +1,234 @@
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#include "gvf.h"
+#include "gauss.h"
+#include "force.h"
+extern "C" {
+#include "pool/pool.h"
+}
+
+/// Smallest side of the coarsest level.
+#define GVF_MIN_SIZE 16
+/// Rows per band of a half sweep.
+#define GVF_ROWS 32
+/// Levels smaller than this many pixels are swept on the calling
+/// thread, the pool round trips would cost more than the sweep.
+#define GVF_POOL_MIN (128 * 128)
+
+// One level of the solve, all planes w x h row major. b is |grad f|^2
+// and (c1, c2) = b * grad f, the constant part of the equations; mu
+// is in the pixels of the level.
+struct gvfLevel {
+    int w;
+    int h;
+    double mu;
+    double omega;
+    std::vector<float> u;
+    std::vector<float> v;
+    std::vector<float> b;
+    std::vector<float> c1;
+    std::vector<float> c2;
+};
+
+// Rows [begin, end) of lv, pixels with (x + y) % 2 == color.
+struct gvfBand {
+    struct gvfLevel *lv;
+    int begin;
+    int end;
+    int color;
+};
+
+static void gvfSweepTask(void *arg) {
+    struct gvfBand *band = (struct gvfBand *) arg;
+    struct gvfLevel& lv = *band->lv;
+    int w = lv.w;
+    int h = lv.h;
+    float mu = lv.mu;
+    float omega = lv.omega;
+    float *u = lv.u.data();
+    float *v = lv.v.data();
+    for (int y = band->begin; y < band->end; y++) {
+        for (int x = (y + band->color) & 1; x < w; x += 2) {
+            size_t i = (size_t) y * w + x;
+            float su = 0;
+            float sv = 0;
+            int k = 0;
+            if (x > 0) {
+                su += u[i - 1];
+                sv += v[i - 1];
+                k++;
+            }
+            if (x < w - 1) {
+                su += u[i + 1];
+                sv += v[i + 1];
+                k++;
+            }
+            if (y > 0) {
+                su += u[i - w];
+                sv += v[i - w];
+                k++;
+            }
+            if (y < h - 1) {
+                su += u[i + w];
+                sv += v[i + w];
+                k++;
+            }
+            float d = k * mu + lv.b[i];
+            if (d <= 0)
+                continue;
+            u[i] += omega * ((mu * su + lv.c1[i]) / d - u[i]);
+            v[i] += omega * ((mu * sv + lv.c2[i]) / d - v[i]);
+        }
+    }
+}
+
+static void gvfRun(struct pool *p, std::vector<struct gvfBand>& bands) {
+    if (!p) {
+        for (struct gvfBand& b : bands)
+            gvfSweepTask(&b);
+        return;
+    }
+    struct waitGroup wg;
+    waitGroupInit(&wg);
+    for (struct gvfBand& b : bands) {
+        struct task t = { gvfSweepTask, &b, &wg };
+        poolAddTask(p, t);
+    }
+    waitGroupWait(&wg);
+    waitGroupFree(&wg);
+}
+
+// niter red-black sweeps over lv. A half sweep only reads pixels of
+// the other color, so its bands run in any order.
+static void gvfSolve(struct gvfLevel& lv, int niter, struct pool *p) {
+    std::vector<struct gvfBand> red;
+    std::vector<struct gvfBand> black;
+    for (int y = 0; y < lv.h; y += GVF_ROWS) {
+        int end = std::min(y + GVF_ROWS, lv.h);
+        red.push_back({ &lv, y, end, 0 });
+        black.push_back({ &lv, y, end, 1 });
+    }
+    if ((long) lv.w * lv.h < GVF_POOL_MIN)
+        p = NULL;
+    for (int i = 0; i < niter; i++) {
+        gvfRun(p, red);
+        gvfRun(p, black);
+    }
+}
+
+static void gvfLevelInit(struct gvfLevel& lv, int w, int h, double mu) {
+    size_t n = (size_t) w * h;
+    lv.w = w;
+    lv.h = h;
+    lv.mu = mu;
+    // optimal for the Laplacian on a grid of that size
+    lv.omega = 2 / (1 + std::sin(M_PI / std::max(w, h)));
+    lv.u.resize(n);
+    lv.v.resize(n);
+    lv.b.resize(n);
+    lv.c1.resize(n);
+    lv.c2.resize(n);
+}
+
+// Average 2 x 2 blocks of fine into a new level, mu scaled for pixels
+// twice as large.
+static void gvfRestrict(const struct gvfLevel& fine, struct gvfLevel& lv) {
+    gvfLevelInit(lv, (fine.w + 1) / 2, (fine.h + 1) / 2, fine.mu / 4);
+    for (int y = 0; y < lv.h; y++) {
+        for (int x = 0; x < lv.w; x++) {
+            float u = 0, v = 0, b = 0, c1 = 0, c2 = 0;
+            int k = 0;
+            for (int fy = 2 * y; fy < std::min(2 * y + 2, fine.h); fy++) {
+                for (int fx = 2 * x; fx < std::min(2 * x + 2, fine.w); fx++) {
+                    size_t j = (size_t) fy * fine.w + fx;
+                    u += fine.u[j];
+                    v += fine.v[j];
+                    b += fine.b[j];
+                    c1 += fine.c1[j];
+                    c2 += fine.c2[j];
+                    k++;
+                }
+            }
+            size_t i = (size_t) y * lv.w + x;
+            lv.u[i] = u / k;
+            lv.v[i] = v / k;
+            lv.b[i] = b / k;
+            lv.c1[i] = c1 / k;
+            lv.c2[i] = c2 / k;
+        }
+    }
+}
+
+// Initial guess of fine from the solution of the level below it.
+static void gvfProlong(const struct gvfLevel& coarse, struct gvfLevel& fine) {
+    for (int y = 0; y < fine.h; y++) {
+        for (int x = 0; x < fine.w; x++) {
+            size_t i = (size_t) y * fine.w + x;
+            size_t j = (size_t) (y / 2) * coarse.w + x / 2;
+            fine.u[i] = coarse.u[j];
+            fine.v[i] = coarse.v[j];
+        }
+    }
+}
+
+void gvfForce(
+        const float *img,
+        int w,
+        int h,
+        double sigma,
+        double mu,
+        int niter,
+        struct forceField& ff,
+        struct pool *p) {
+    struct forceField grad;
+    forceFieldInit(grad, w, h, SNAKE_FORCE_FLOAT32);
+    gaussForce(img, w, h, sigma, grad, p);
+
+    double scale = 0;
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            const float *f = grad.f32 + forceIndex(grad, x, y);
+            scale = std::max(scale, std::hypot((double) f[0], (double) f[1]));
+        }
+    }
+    if (scale == 0)
+        return;
+
+    std::vector<struct gvfLevel> levels(1);
+    struct gvfLevel& top = levels[0];
+    gvfLevelInit(top, w, h, mu);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            const float *f = grad.f32 + forceIndex(grad, x, y);
+            size_t i = (size_t) y * w + x;
+            float fx = f[0] / scale;
+            float fy = f[1] / scale;
+            float b = fx * fx + fy * fy;
+            top.u[i] = fx;
+            top.v[i] = fy;
+            top.b[i] = b;
+            top.c1[i] = b * fx;
+            top.c2[i] = b * fy;
+        }
+    }
+    grad = forceField();
+
+    while (std::min(levels.back().w, levels.back().h) / 2 >= GVF_MIN_SIZE) {
+        levels.emplace_back();
+        gvfRestrict(levels[levels.size() - 2], levels.back());
+    }
+    for (size_t l = levels.size() - 1; l > 0; l--) {
+        gvfSolve(levels[l], niter, p);
+        gvfProlong(levels[l], levels[l - 1]);
+    }
+    gvfSolve(levels[0], niter, p);
+
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            size_t i = (size_t) y * w + x;
+            forceFieldSet(ff, x, y, scale * levels[0].u[i],
+                scale * levels[0].v[i]);
+        }
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef GVF_H
+#define GVF_H
+
+struct pool;
+struct forceField;
+
+// Gradient vector flow
+// ========================================================
+// Xu - Prince GVF: the field (u, v) minimising
+//
+//   mu |grad u|^2 + mu |grad v|^2 + |grad f|^2 |(u, v) - grad f|^2
+//
+// where grad f is the gradient force of gaussForce at sigma. Near
+// edges (u, v) stays grad f, away from them it is the diffusion of
+// it, so snakes are pulled in from far outside the reach of grad f.
+// grad f is normalised to a largest magnitude of 1 for the solve (mu
+// does not depend on the image contrast) and scaled back after.
+//
+// The Euler - Lagrange equations mu lap(u) = |grad f|^2 (u - fx),
+// and the same for v, are solved by red-black SOR with Neumann
+// borders, coarse to fine: every level halves the one above it down
+// to GVF_MIN_SIZE, its solution is the initial guess of the next one
+// and niter sweeps are run per level. The red and black half sweeps
+// are spread over the workers of p by bands of rows (running, or
+// NULL to run on the calling thread). The result goes into ff, set up
+// for w x h (forceFieldInit).
+void gvfForce(
+        const float *img,
+        int w,
+        int h,
+        double sigma,
+        double mu,
+        int niter,
+        struct forceField& ff,
+        struct pool *p);
+
+#endif
@@ -0,0 +1,174 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include "internal.h"
+
+// The dense inverse is built column by column from the banded
+// factor (in double), which keeps LAPACK out of the build. Its
+// entries decay geometrically away from the diagonal; the ones below
+// the smallest normal T are dropped, denormals would make every
+// product with them many times slower.
+template <typename T>
+static T flushDenormal(double v) {
+    return std::fabs(v) < std::numeric_limits<T>::min() ? 0 : v;
+}
+
+template <typename T>
+static void fillDenseInverse(
+        struct internal<T>& in,
+        double a,
+        double b,
+        double c,
+        int n) {
+    struct pentadiag<double> pd;
+    pentadiagFactor(pd, a, b, c, n);
+    in.inv.assign((size_t) n * n, 0);
+    std::vector<double> colx(n);
+    std::vector<double> coly(n);
+    for (int j = 0; j < n; j += 2) {
+        int k = (j + 1 < n) ? j + 1 : j;
+        std::fill(colx.begin(), colx.end(), 0.0);
+        std::fill(coly.begin(), coly.end(), 0.0);
+        colx[j] = 1.0;
+        coly[k] = 1.0;
+        pentadiagSolve(pd, colx.data(), coly.data());
+        for (int i = 0; i < n; i++) {
+            in.inv[(size_t) i * n + j] = flushDenormal<T>(colx[i]);
+            in.inv[(size_t) i * n + k] = flushDenormal<T>(coly[i]);
+        }
+    }
+}
+
+template <typename T>
+void internalInit(
+        struct internal<T>& in,
+        enum snakeEngine engine,
+        double alpha,
+        double beta,
+        double gamma,
+        int n) {
+    double a = gamma * (2 * alpha + 6 * beta) + 1;
+    double b = gamma * (-alpha - 4 * beta);
+    double c = gamma * beta;
+
+    in.engine = engine;
+    switch (engine) {
+        case SNAKE_ENGINE_BANDED: {
+            pentadiagFactor(in.pd, a, b, c, n);
+            break;
+        }
+        case SNAKE_ENGINE_FFT: {
+            circulantFactor(in.cf, a, b, c, n);
+            break;
+        }
+        case SNAKE_ENGINE_DENSE: {
+            in.pd.n = n;
+            fillDenseInverse(in, a, b, c, n);
+            break;
+        }
+    }
+}
+
+typedef std::tuple<int, double, double, double, int> internalKey;
+
+template <typename T>
+struct internalCache {
+    std::mutex lock;
+    std::map<internalKey, std::weak_ptr<const struct internal<T>>> entries;
+};
+
+template <typename T>
+std::shared_ptr<const struct internal<T>> internalGet(
+        enum snakeEngine engine,
+        double alpha,
+        double beta,
+        double gamma,
+        int n) {
+    static struct internalCache<T> cache;
+    internalKey key(engine, alpha, beta, gamma, n);
+    std::lock_guard<std::mutex> guard(cache.lock);
+    std::weak_ptr<const struct internal<T>>& entry = cache.entries[key];
+    std::shared_ptr<const struct internal<T>> in = entry.lock();
+    if (in)
+        return in;
+
+    // Drop the entries nobody holds any more before adding one.
+    for (auto it = cache.entries.begin(); it != cache.entries.end();) {
+        if (it->second.expired() && it->first != key)
+            it = cache.entries.erase(it);
+        else
+            ++it;
+    }
+    std::shared_ptr<struct internal<T>> made =
+        std::make_shared<struct internal<T>>();
+    internalInit(*made, engine, alpha, beta, gamma, n);
+    entry = made;
+    return made;
+}
+
+template <typename T>
+static void denseSolve(
+        const struct internal<T>& in,
+        T *x,
+        T *y,
+        struct internalWork<T>& work) {
+    int n = in.pd.n;
+    work.tmp.resize(2 * n);
+    T *tx = work.tmp.data();
+    T *ty = tx + n;
+    for (int i = 0; i < n; i++) {
+        const T *row = &in.inv[(size_t) i * n];
+        T sumx = 0;
+        T sumy = 0;
+        for (int j = 0; j < n; j++) {
+            sumx += row[j] * x[j];
+            sumy += row[j] * y[j];
+        }
+        tx[i] = sumx;
+        ty[i] = sumy;
+    }
+    std::copy(tx, tx + n, x);
+    std::copy(ty, ty + n, y);
+}
+
+template <typename T>
+void internalSolve(
+        const struct internal<T>& in,
+        T *x,
+        T *y,
+        struct internalWork<T>& work) {
+    switch (in.engine) {
+        case SNAKE_ENGINE_BANDED: {
+            pentadiagSolve(in.pd, x, y);
+            break;
+        }
+        case SNAKE_ENGINE_FFT: {
+            circulantSolve(in.cf, x, y, work.fft);
+            break;
+        }
+        case SNAKE_ENGINE_DENSE: {
+            denseSolve(in, x, y, work);
+            break;
+        }
+    }
+}
+
+template void internalInit<float>(
+        struct internal<float>&, enum snakeEngine,
+        double, double, double, int);
+template void internalInit<double>(
+        struct internal<double>&, enum snakeEngine,
+        double, double, double, int);
+template std::shared_ptr<const struct internal<float>> internalGet<float>(
+        enum snakeEngine, double, double, double, int);
+template std::shared_ptr<const struct internal<double>> internalGet<double>(
+        enum snakeEngine, double, double, double, int);
+template void internalSolve<float>(
+        const struct internal<float>&, float *, float *,
+        struct internalWork<float>&);
+template void internalSolve<double>(
+        const struct internal<double>&, double *, double *,
+        struct internalWork<double>&);
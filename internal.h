@@ -0,0 +1,69 @@
+#ifndef INTERNAL_H
+#define INTERNAL_H
+
+#include <complex>
+#include <memory>
+#include <vector>
+#include "snake.h"
+#include "pentadiag.h"
+#include "circulant.h"
+
+// Internal energy step
+// ========================================================
+// Applies (I - gamma * A)^-1 to a contour of n points with the
+// engine picked at snakeInit time.
+//
+// SNAKE_ENGINE_BANDED  O(n) cyclic pentadiagonal Cholesky (default)
+// SNAKE_ENGINE_FFT     O(n log n) pointwise multiply in the DFT domain
+// SNAKE_ENGINE_DENSE   O(n^2) explicit inverse, kept as a reference
+//
+// T is the scalar type of the contours it is applied to, float or
+// double (snakeSetPrecision).
+template <typename T>
+struct internal {
+    enum snakeEngine engine;
+    struct pentadiag<T> pd;
+    struct circulant<T> cf;
+    std::vector<T> inv;
+};
+
+// Scratch space of internalSolve. The operator itself is read only
+// while solving, so threads share it and keep one of these each.
+template <typename T>
+struct internalWork {
+    std::vector<T> tmp;
+    std::vector<std::complex<T>> fft;
+};
+
+template <typename T>
+void internalInit(
+        struct internal<T>& in,
+        enum snakeEngine engine,
+        double alpha,
+        double beta,
+        double gamma,
+        int n);
+
+// Operator cache
+// ========================================================
+// The operator only depends on (engine, alpha, beta, gamma, n), so
+// snakes and batches with the same parameters share one read only
+// copy. The process-wide cache (one per T) holds weak references: an
+// operator is factored once and lives while some snake holds it.
+// Thread safe.
+template <typename T>
+std::shared_ptr<const struct internal<T>> internalGet(
+        enum snakeEngine engine,
+        double alpha,
+        double beta,
+        double gamma,
+        int n);
+
+template <typename T>
+void internalSolve(
+        const struct internal<T>& in,
+        T *x,
+        T *y,
+        struct internalWork<T>& work);
+
+#endif
@@ -0,0 +1,164 @@
+// Snake batch kernels
+// ========================================================
+// One iteration of a batch (snake.cpp) on an OpenCL device: sample
+// runs one work item per point, solve one per snake. Points are
+// stored back to back, snake s owning [off[s], off[s + 1]); owner
+// maps a point to its snake and snakes with moving[s] == 0 are left
+// alone. Everything is float.
+//
+// Built with -DFORCE_TILE_SHIFT=<n> of force.h, the field being the
+// tiled (fx, fy) layout described there uploaded as is, and with
+// -DNORM_MAX=<SNAKE_NORM_MAX>.
+#define FORCE_TILE (1 << FORCE_TILE_SHIFT)
+#define FORCE_TILE_MASK (FORCE_TILE - 1)
+#define FORCE_TILE_SIZE (2 * FORCE_TILE * FORCE_TILE)
+
+// Index of fx of pixel (x, y), fy follows it.
+inline size_t forceIndex(int tilesX, int x, int y) {
+    size_t tile = (size_t) (y >> FORCE_TILE_SHIFT) * tilesX
+        + (x >> FORCE_TILE_SHIFT);
+    return tile * FORCE_TILE_SIZE
+        + (((y & FORCE_TILE_MASK) << FORCE_TILE_SHIFT)
+        + (x & FORCE_TILE_MASK)) * 2;
+}
+
+// Keep the point in (px, py), sample the force bilinearly (clamped
+// to the image) and take the external step.
+__kernel void sample(
+        __global const float *field,
+        int width,
+        int height,
+        int tilesX,
+        __global float *x,
+        __global float *y,
+        __global float *px,
+        __global float *py,
+        __global const int *owner,
+        __global const char *moving,
+        float gamma,
+        int npoints) {
+    int i = get_global_id(0);
+    if (i >= npoints || !moving[owner[i]])
+        return;
+    float xi = x[i];
+    float yi = y[i];
+    px[i] = xi;
+    py[i] = yi;
+
+    float xc = clamp(xi, 0.0f, (float) (width - 1));
+    float yc = clamp(yi, 0.0f, (float) (height - 1));
+    int x0 = min((int) xc, width - 2);
+    int y0 = min((int) yc, height - 2);
+    float tx = xc - x0;
+    float ty = yc - y0;
+    __global const float *p00 = field + forceIndex(tilesX, x0, y0);
+    __global const float *p01 = field + forceIndex(tilesX, x0 + 1, y0);
+    __global const float *p10 = field + forceIndex(tilesX, x0, y0 + 1);
+    __global const float *p11 = field + forceIndex(tilesX, x0 + 1, y0 + 1);
+    float ax = p00[0] + tx * (p01[0] - p00[0]);
+    float bx = p10[0] + tx * (p11[0] - p10[0]);
+    float ay = p00[1] + tx * (p01[1] - p00[1]);
+    float by = p10[1] + tx * (p11[1] - p10[1]);
+    x[i] = xi + gamma * (ax + ty * (bx - ax));
+    y[i] = yi + gamma * (ay + ty * (by - ay));
+}
+
+// Internal step of one snake: the cyclic pentadiagonal solve of
+// pentadiag.cpp in place, with the factor of snake s stored like its
+// points (d, e, f, g, h at off[s], k[s]). Then the displacement test
+// of the iteration, which clears moving[s] once it is at most tol
+// (never while it is NaN).
+__kernel void solve(
+        __global float *xs,
+        __global float *ys,
+        __global const float *pxs,
+        __global const float *pys,
+        __global const int *off,
+        __global const float *ds,
+        __global const float *es,
+        __global const float *fs,
+        __global const float *gs,
+        __global const float *hs,
+        __global const int *ks,
+        __global char *moving,
+        int norm,
+        float tol,
+        int nsnakes) {
+    int s = get_global_id(0);
+    if (s >= nsnakes || !moving[s])
+        return;
+    int begin = off[s];
+    int n = off[s + 1] - begin;
+    int m = n - 2;
+    int k = ks[s];
+    __global float *x = xs + begin;
+    __global float *y = ys + begin;
+    __global const float *d = ds + begin;
+    __global const float *e = es + begin;
+    __global const float *f = fs + begin;
+    __global const float *g = gs + begin;
+    __global const float *h = hs + begin;
+
+    // forward substitution L * w = rhs
+    x[0] *= d[0];
+    y[0] *= d[0];
+    x[1] = (x[1] - e[1] * x[0]) * d[1];
+    y[1] = (y[1] - e[1] * y[0]) * d[1];
+    for (int i = 2; i < m; i++) {
+        x[i] = (x[i] - e[i] * x[i - 1] - f[i] * x[i - 2]) * d[i];
+        y[i] = (y[i] - e[i] * y[i - 1] - f[i] * y[i - 2]) * d[i];
+    }
+    float gx = 0;
+    float gy = 0;
+    float hx = 0;
+    float hy = 0;
+    for (int j = 0; j < k; j++) {
+        gx += g[j] * x[j];
+        gy += g[j] * y[j];
+        hx += h[j] * x[j];
+        hy += h[j] * y[j];
+    }
+    for (int j = max(k, m - 2); j < m; j++) {
+        gx += g[j] * x[j];
+        gy += g[j] * y[j];
+        hx += h[j] * x[j];
+        hy += h[j] * y[j];
+    }
+    x[m] = (x[m] - gx) * d[m];
+    y[m] = (y[m] - gy) * d[m];
+    x[m + 1] = (x[m + 1] - hx - h[m] * x[m]) * d[m + 1];
+    y[m + 1] = (y[m + 1] - hy - h[m] * y[m]) * d[m + 1];
+
+    // backward substitution L^T * u = w
+    x[m + 1] *= d[m + 1];
+    y[m + 1] *= d[m + 1];
+    x[m] = (x[m] - h[m] * x[m + 1]) * d[m];
+    y[m] = (y[m] - h[m] * y[m + 1]) * d[m];
+    float xm = x[m];
+    float ym = y[m];
+    float xm1 = x[m + 1];
+    float ym1 = y[m + 1];
+    for (int i = m - 1; i >= 0; i--) {
+        x[i] = (x[i] - e[i + 1] * x[i + 1] - f[i + 2] * x[i + 2]
+                - g[i] * xm - h[i] * xm1) * d[i];
+        y[i] = (y[i] - e[i + 1] * y[i + 1] - f[i + 2] * y[i + 2]
+                - g[i] * ym - h[i] * ym1) * d[i];
+    }
+
+    __global const float *px = pxs + begin;
+    __global const float *py = pys + begin;
+    float acc = 0;
+    for (int i = 0; i < n; i++) {
+        float dx = x[i] - px[i];
+        float dy = y[i] - py[i];
+        float d2 = dx * dx + dy * dy;
+        // fmax would drop a NaN d2, a diverged snake keeps moving
+        if (norm == NORM_MAX && (d2 > acc || isnan(d2)))
+            acc = d2;
+        else if (norm != NORM_MAX)
+            acc += d2;
+    }
+    if (norm != NORM_MAX)
+        acc /= n;
+    moving[s] = !(sqrt(acc) <= tol);
+}
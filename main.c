@@ -147,8 +147,16 @@ void envInit(
     imageRead(im, ics);
     contourInit(con, 1024);
     energyInit(en);
-    energyCalculateForce(en, im, 30.0);
-    snakeInit(snake, im, con, en, 0.001, 0.4, 100);
+    // The force is cached next to the image, later runs map it.
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s", ics);
+    char *slash = strrchr(dir, '/');
+    if (slash)
+        *slash = '\0';
+    else
+        snprintf(dir, sizeof(dir), ".");
+    energyLoadOrCalculateForce(en, im, 30.0, dir);
+    snakeInit(snake, con, en, 0.001, 0.4, 100, SNAKE_ENGINE_BANDED);
 
     imageFree(im);
     contourFree(con);
@@ -0,0 +1,163 @@
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include "pentadiag.h"
+
+// The dense rows decay geometrically away from the first columns.
+// Entries below PENTADIAG_EPS relative to the diagonal are far under
+// the rounding of the solve, so they are dropped and the dot product
+// with the dense rows only runs over the head and the last columns.
+#define PENTADIAG_EPS 1e-20
+
+static double entry(double a, double b, double c, int n, int i, int j) {
+    int k = std::abs(i - j);
+    k = std::min(k, n - k);
+    if (k == 0)
+        return a;
+    else if (k == 1)
+        return b;
+    else if (k == 2)
+        return c;
+    return 0.0;
+}
+
+static void factor(
+        struct pentadiag<double>& pd,
+        double a,
+        double b,
+        double c,
+        int n) {
+    int m = n - 2;
+    pd.n = n;
+    pd.d.assign(n, 0.0);
+    pd.e.assign(n, 0.0);
+    pd.f.assign(n, 0.0);
+    pd.g.assign(n, 0.0);
+    pd.h.assign(n, 0.0);
+
+    // banded rows, nothing fills in above row n-2
+    for (int i = 0; i < m; i++) {
+        double f = (i >= 2) ? c * pd.d[i - 2] : 0.0;
+        double e = (i >= 1) ? (b - f * pd.e[i - 1]) * pd.d[i - 1] : 0.0;
+        pd.f[i] = f;
+        pd.e[i] = e;
+        pd.d[i] = 1.0 / std::sqrt(a - e * e - f * f);
+    }
+
+    // the two dense rows picked up from the cyclic corners
+    double tiny = PENTADIAG_EPS * std::sqrt(a);
+    pd.k = 0;
+    for (int r = m; r < n; r++) {
+        std::vector<double>& l = (r == m) ? pd.g : pd.h;
+        for (int j = 0; j < m; j++) {
+            double s = entry(a, b, c, n, r, j);
+            if (j >= 1)
+                s -= l[j - 1] * pd.e[j];
+            if (j >= 2)
+                s -= l[j - 2] * pd.f[j];
+            l[j] = s * pd.d[j];
+            if (std::fabs(l[j]) < tiny)
+                l[j] = 0.0;
+            else if (j < m - 2)
+                pd.k = std::max(pd.k, j + 1);
+        }
+    }
+    double sg = 0.0;
+    double sh = 0.0;
+    for (int j = 0; j < m; j++) {
+        sg += pd.g[j] * pd.g[j];
+        sh += pd.h[j] * pd.g[j];
+    }
+    pd.d[m] = 1.0 / std::sqrt(a - sg);
+    pd.h[m] = (entry(a, b, c, n, m + 1, m) - sh) * pd.d[m];
+    sh = 0.0;
+    for (int j = 0; j <= m; j++)
+        sh += pd.h[j] * pd.h[j];
+    pd.d[m + 1] = 1.0 / std::sqrt(a - sh);
+}
+
+template <typename T>
+void pentadiagFactor(
+        struct pentadiag<T>& pd,
+        double a,
+        double b,
+        double c,
+        int n) {
+    struct pentadiag<double> dp;
+    factor(dp, a, b, c, n);
+    pd.n = dp.n;
+    pd.k = dp.k;
+    pd.d.assign(dp.d.begin(), dp.d.end());
+    pd.e.assign(dp.e.begin(), dp.e.end());
+    pd.f.assign(dp.f.begin(), dp.f.end());
+    pd.g.assign(dp.g.begin(), dp.g.end());
+    pd.h.assign(dp.h.begin(), dp.h.end());
+}
+
+template <typename T>
+void pentadiagSolve(const struct pentadiag<T>& pd, T *x, T *y) {
+    int n = pd.n;
+    int m = n - 2;
+    const T *d = pd.d.data();
+    const T *e = pd.e.data();
+    const T *f = pd.f.data();
+    const T *g = pd.g.data();
+    const T *h = pd.h.data();
+
+    // forward substitution L * w = rhs
+    x[0] *= d[0];
+    y[0] *= d[0];
+    x[1] = (x[1] - e[1] * x[0]) * d[1];
+    y[1] = (y[1] - e[1] * y[0]) * d[1];
+    for (int i = 2; i < m; i++) {
+        x[i] = (x[i] - e[i] * x[i - 1] - f[i] * x[i - 2]) * d[i];
+        y[i] = (y[i] - e[i] * y[i - 1] - f[i] * y[i - 2]) * d[i];
+    }
+    T gx = 0;
+    T gy = 0;
+    T hx = 0;
+    T hy = 0;
+    for (int j = 0; j < pd.k; j++) {
+        gx += g[j] * x[j];
+        gy += g[j] * y[j];
+        hx += h[j] * x[j];
+        hy += h[j] * y[j];
+    }
+    for (int j = std::max(pd.k, m - 2); j < m; j++) {
+        gx += g[j] * x[j];
+        gy += g[j] * y[j];
+        hx += h[j] * x[j];
+        hy += h[j] * y[j];
+    }
+    x[m] = (x[m] - gx) * d[m];
+    y[m] = (y[m] - gy) * d[m];
+    x[m + 1] = (x[m + 1] - hx - h[m] * x[m]) * d[m + 1];
+    y[m + 1] = (y[m + 1] - hy - h[m] * y[m]) * d[m + 1];
+
+    // backward substitution L^T * u = w
+    x[m + 1] *= d[m + 1];
+    y[m + 1] *= d[m + 1];
+    x[m] = (x[m] - h[m] * x[m + 1]) * d[m];
+    y[m] = (y[m] - h[m] * y[m + 1]) * d[m];
+    T xm = x[m];
+    T ym = y[m];
+    T xm1 = x[m + 1];
+    T ym1 = y[m + 1];
+    // e and f are zero from row m on, so the band terms vanish
+    // for i = m-1 and i = m-2 without special casing them.
+    for (int i = m - 1; i >= 0; i--) {
+        x[i] = (x[i] - e[i + 1] * x[i + 1] - f[i + 2] * x[i + 2]
+                - g[i] * xm - h[i] * xm1) * d[i];
+        y[i] = (y[i] - e[i + 1] * y[i + 1] - f[i + 2] * y[i + 2]
+                - g[i] * ym - h[i] * ym1) * d[i];
+    }
+}
+
+template void pentadiagFactor<float>(
+        struct pentadiag<float>&, double, double, double, int);
+template void pentadiagFactor<double>(
+        struct pentadiag<double>&, double, double, double, int);
+template void pentadiagSolve<float>(
+        const struct pentadiag<float>&, float *, float *);
+template void pentadiagSolve<double>(
+        const struct pentadiag<double>&, double *, double *);
@@ -0,0 +1,43 @@
+#ifndef PENTADIAG_H
+#define PENTADIAG_H
+
+#include <vector>
+
+// Cyclic pentadiagonal solver
+// ========================================================
+// Cholesky factor M = L * L^T of the symmetric cyclic pentadiagonal
+// matrix with a on the diagonal, b on the first and c on the second
+// (wrapped around) off-diagonals. This is exactly the internal energy
+// matrix of a closed snake.
+//
+// Rows 0..n-3 of L only have the two sub-diagonals. The cyclic corners
+// fill in the last two rows completely, so those are stored as dense
+// rows. Factor and solve are both O(n) and M has to be positive
+// definite (true for any alpha, beta, gamma >= 0) with n >= 5.
+//
+// T is the scalar type of the stored factor and of the solve (float
+// or double); the factor is always computed in double.
+template <typename T>
+struct pentadiag {
+    int n;
+    std::vector<T> d; // 1 / L[i][i]
+    std::vector<T> e; // L[i][i-1], zero for i >= n-2
+    std::vector<T> f; // L[i][i-2], zero for i >= n-2
+    std::vector<T> g; // L[n-2][j], j < n-2
+    std::vector<T> h; // L[n-1][j], j < n-1
+    int k;            // g, h are zero on [k, n-4)
+};
+
+template <typename T>
+void pentadiagFactor(
+        struct pentadiag<T>& pd,
+        double a,
+        double b,
+        double c,
+        int n);
+
+// Solve M * u = x and M * v = y in place.
+template <typename T>
+void pentadiagSolve(const struct pentadiag<T>& pd, T *x, T *y);
+
+#endif
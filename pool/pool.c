@@ -20,117 +20,512 @@
 /// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 /// SOFTWARE.
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sched.h>
 #include <pthread.h>
-#include <semaphore.h>
 
 #include "pool.h"
 
-#define ARRAYLEN(a) (sizeof(a)/sizeof(a[0]))
+/// Atomics
+/// =======
+/// GCC builtins instead of stdatomic.h, so pool.h stays
+/// usable from C++ translation units.
+#define LOAD(v, o) __atomic_load_n(&(v), o)
+#define STORE(v, x, o) __atomic_store_n(&(v), x, o)
+#define CAS(v, e, x) __atomic_compare_exchange_n(&(v), e, x, 1, \
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#define FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define CPU_RELAX() __builtin_ia32_pause()
+#else
+  #define CPU_RELAX() ((void) 0)
+#endif
 
 /// taskQueue implementation
 /// ========================
-#define taskQueueInit(q) ((q)->head = (q)->tail = (q)->n = 0)
-#define taskQueueFree(q) taskQueueInit(q)
-#define taskQueueIsEmpty(q) ((q)->n == 0)
-
-void taskQueueEnqueue(struct taskQueue *q, struct task task) {
-    q->tasks[q->tail] = task;
-    q->tail = (q->tail + 1) % ARRAYLEN((q)->tasks);
-    q->n++;
-}
-
-struct task taskQueueDequeue(struct taskQueue *q) {
-    struct task task = q->tasks[q->head];
-    q->head = (q->head + 1) % ARRAYLEN((q)->tasks);
-    q->n--;
-    return task; 
-}
-
-/// Semaphore manipulation
-/// ====================== 
-#define UP(s) (sem_post(s))
-#define DOWN(s) (sem_wait(s))
-#define FILLCOUNT_UP(p) UP(&p->fcount)
-#define FILLCOUNT_DOWN(p) DOWN(&p->fcount)
-#define EMPTYCOUNT_UP(p) UP(&p->ecount)
-#define EMPTYCOUNT_DOWN(p) DOWN(&p->ecount)
-#define LOCK(p) DOWN(&p->lock)
-#define UNLOCK(p) UP(&p->lock)
+/// Bounded MPMC ring by Dmitry Vyukov. Every slot carries a
+/// sequence number: a producer may fill slot (pos & mask) when
+/// its seq is pos, a consumer may empty it when its seq is pos + 1.
+/// The position is claimed with a single CAS on tail or head.
+///
+static int taskQueueInit(struct taskQueue *q, int size) {
+    size_t cap = 2;
+    while (cap < (size_t)size)
+        cap <<= 1;
+    q->slots = malloc(sizeof(struct taskSlot) * cap);
+    if (!q->slots)
+        return -1;
+    for (size_t i = 0; i < cap; i++)
+        q->slots[i].seq = i;
+    q->mask = cap - 1;
+    q->head = 0;
+    q->tail = 0;
+    return 0;
+}
+
+static void taskQueueFree(struct taskQueue *q) {
+    free(q->slots);
+    q->slots = NULL;
+}
+
+static int taskQueueEnqueue(struct taskQueue *q, struct task task) {
+    size_t pos = LOAD(q->tail, __ATOMIC_RELAXED);
+    struct taskSlot *slot;
+    while (1) {
+        slot = &q->slots[pos & q->mask];
+        size_t seq = LOAD(slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (CAS(q->tail, &pos, pos + 1))
+                break;
+        } else if (dif < 0) {
+            return 0;
+        } else {
+            pos = LOAD(q->tail, __ATOMIC_RELAXED);
+        }
+    }
+    slot->task = task;
+    STORE(slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static int taskQueueDequeue(struct taskQueue *q, struct task *task) {
+    size_t pos = LOAD(q->head, __ATOMIC_RELAXED);
+    struct taskSlot *slot;
+    while (1) {
+        slot = &q->slots[pos & q->mask];
+        size_t seq = LOAD(slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            if (CAS(q->head, &pos, pos + 1))
+                break;
+        } else if (dif < 0) {
+            return 0;
+        } else {
+            pos = LOAD(q->head, __ATOMIC_RELAXED);
+        }
+    }
+    *task = slot->task;
+    STORE(slot->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/// taskDeque implementation
+/// ========================
+/// Chase-Lev deque with a fixed size array (Le et al., "Correct and
+/// Efficient Work-Stealing for Weak Memory Models"). A thief may read
+/// a slot the owner is overwriting, but then its CAS on top fails and
+/// the torn copy is thrown away.
+///
+static int taskDequeInit(struct taskDeque *d, int size) {
+    long cap = 2;
+    while (cap < size)
+        cap <<= 1;
+    d->tasks = malloc(sizeof(struct task) * cap);
+    if (!d->tasks)
+        return -1;
+    d->mask = cap - 1;
+    d->top = 0;
+    d->bottom = 0;
+    return 0;
+}
+
+static void taskDequeFree(struct taskDeque *d) {
+    free(d->tasks);
+    d->tasks = NULL;
+}
+
+/// Owner only. Returns 0 when the deque is full.
+static int taskDequePush(struct taskDeque *d, struct task task) {
+    long b = LOAD(d->bottom, __ATOMIC_RELAXED);
+    long t = LOAD(d->top, __ATOMIC_ACQUIRE);
+    if (b - t > d->mask)
+        return 0;
+    d->tasks[b & d->mask] = task;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    STORE(d->bottom, b + 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/// Owner only. Takes the most recently pushed task.
+static int taskDequeTake(struct taskDeque *d, struct task *task) {
+    long b = LOAD(d->bottom, __ATOMIC_RELAXED) - 1;
+    STORE(d->bottom, b, __ATOMIC_RELAXED);
+    FENCE();
+    long t = LOAD(d->top, __ATOMIC_RELAXED);
+    if (t > b) {
+        STORE(d->bottom, b + 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    *task = d->tasks[b & d->mask];
+    if (t == b) {
+        // last task, race the thieves for it
+        int won = __atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+        STORE(d->bottom, b + 1, __ATOMIC_RELAXED);
+        return won;
+    }
+    return 1;
+}
+
+/// Any thread. Takes the oldest task. Returns 1 on success,
+/// 0 when empty and -1 when it lost a race and should retry.
+static int taskDequeSteal(struct taskDeque *d, struct task *task) {
+    long t = LOAD(d->top, __ATOMIC_ACQUIRE);
+    FENCE();
+    long b = LOAD(d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+        return 0;
+    *task = d->tasks[t & d->mask];
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return -1;
+    return 1;
+}
+
+/// Worker of the calling thread, NULL outside of pool workers.
+static __thread struct poolWorker *self;
+
+/// Parking
+/// =======
+/// Threads spin on the queue for a while and then park on a
+/// condition variable. A parking thread bumps its sleepers count
+/// and re-checks the queue under the lock; the other side publishes
+/// its queue change and then reads the sleepers count. With a full
+/// fence on both sides at least one of them sees the other, so no
+/// wake up is lost, and nobody touches the lock while nobody sleeps.
+///
+static void wake(struct pool *p, int *sleepers, pthread_cond_t *cond) {
+    FENCE();
+    if (LOAD(*sleepers, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_signal(cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+#define WAKE_WORKER(p) wake(p, &(p)->fsleepers, &(p)->fcond)
+#define WAKE_PRODUCER(p) wake(p, &(p)->esleepers, &(p)->econd)
+
+/// poolFindTask
+/// ============
+/// One attempt to find a task for worker @w.
+/// Shared mode: dequeue from the queue of the own node, then from
+/// the queues of the other nodes.
+/// Stealing mode: take from the own deque, then the queues (tasks
+/// added from outside the pool), then steal. A quick attempt tries
+/// one random victim, a thorough one tries every victim until they
+/// are really empty.
+///
+static int poolFindTask(struct poolWorker *w, struct task *t, int thorough) {
+    struct pool *p = w->p;
+    if (p->mode == POOL_MODE_STEALING && taskDequeTake(&w->dq, t))
+        return 1;
+    for (int i = 0; i < p->nnodes; i++)
+        if (taskQueueDequeue(&p->q[(w->node + i) % p->nnodes], t))
+            return 1;
+    if (p->mode == POOL_MODE_SHARED)
+        return 0;
+
+    int n = p->nworkers;
+    if (!thorough) {
+        struct poolWorker *v = &p->workers[rand_r(&w->seed) % n];
+        return v != w && taskDequeSteal(&v->dq, t) == 1;
+    }
+    int start = rand_r(&w->seed) % n;
+    for (int i = 0; i < n; i++) {
+        struct poolWorker *v = &p->workers[(start + i) % n];
+        if (v == w)
+            continue;
+        int r;
+        while ((r = taskDequeSteal(&v->dq, t)) < 0)
+            CPU_RELAX();
+        if (r)
+            return 1;
+    }
+    return 0;
+}
+
+/// poolTakeTask
+/// ============
+/// Get the next task for worker @w. Returns 0 when the pool
+/// is shutdown and there is no task left anywhere.
+///
+static int poolTakeTask(struct poolWorker *w, struct task *t) {
+    struct pool *p = w->p;
+    for (int i = 0; i < p->spin; i++) {
+        if (poolFindTask(w, t, 0))
+            goto taken;
+        CPU_RELAX();
+    }
+    pthread_mutex_lock(&p->lock);
+    __atomic_add_fetch(&p->fsleepers, 1, __ATOMIC_SEQ_CST);
+    FENCE();
+    while (!poolFindTask(w, t, 1)) {
+        if (LOAD(p->shutdown, __ATOMIC_SEQ_CST)) {
+            __atomic_sub_fetch(&p->fsleepers, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&p->lock);
+            return 0;
+        }
+        pthread_cond_wait(&p->fcond, &p->lock);
+    }
+    __atomic_sub_fetch(&p->fsleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&p->lock);
+taken:
+    WAKE_PRODUCER(p);
+    return 1;
+}
+
+/// runTask
+/// =======
+/// Run the task and mark it done in its wait group.
+///
+static void runTask(struct task t) {
+    (*t.fn)(t.arg);
+    if (t.wg)
+        waitGroupDone(t.wg);
+}
 
 /// worker
 /// ======
-/// 1. Decrement the fill count.   
-/// 2. Enter the critical section.
-/// 3. Check whether the task queue is empty.
-///    If it is empty that means the pool is shutdown
-///    and this is only a wake up call. So, worker should
-///    stop working.
-/// 4. Get a task from the queue.
-/// 5. Leave the critical section.   
-/// 6. Increment the empty count.
+/// 1. Find a task, spinning and then parking while there is none.
+/// 2. If there is none and the pool is shutdown, stop working.
+/// 3. Run the task and mark it done in its wait group.
 ///
 static void *worker(void *arg) {
-    struct pool *p = (struct pool *)arg;
+    struct poolWorker *w = (struct poolWorker *)arg;
+    struct task t;
 
-    while (1) {
-        FILLCOUNT_DOWN(p);
-        LOCK(p);
-        if (taskQueueIsEmpty(&p->q))
+    self = w;
+    while (poolTakeTask(w, &t))
+        runTask(t);
+    return NULL;
+}
+
+/// poolAttrInit
+/// ============
+/// Fill attributes with the defaults.
+///
+void poolAttrInit(struct poolAttr *a) {
+    a->nworkers = 0;
+    a->qsize = TASK_QUEUE_SIZE;
+    a->spin = POOL_SPIN;
+    a->mode = POOL_MODE_SHARED;
+    a->pin = 0;
+    a->numa = 0;
+}
+
+/// cpuNode
+/// =======
+/// NUMA node of @cpu, read from the nodeN link sysfs keeps in the
+/// directory of every CPU. 0 when the kernel has no NUMA support.
+///
+static int cpuNode(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return 0;
+    int node = 0;
+    struct dirent *e;
+    while ((e = readdir(dir))) {
+        if (!strncmp(e->d_name, "node", 4) && isdigit(e->d_name[4])) {
+            node = atoi(e->d_name + 4);
             break;
-        struct task t = taskQueueDequeue(&p->q);
-        UNLOCK(p);
-        EMPTYCOUNT_UP(p);
-        (*t.fn)(t.arg);
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+/// poolPlaceWorkers
+/// ================
+/// Size the pool and give every worker a node and, when pinning,
+/// a CPU. Only CPUs in the affinity mask of the calling thread are
+/// used. Every worker gets a CPU, even when it is not pinned, to
+/// know its node by. With NUMA partitioning workers are dealt over the nodes
+/// round robin and over the CPUs of their node; otherwise worker
+/// i gets allowed CPU i, wrapping around when there are more
+/// workers than CPUs.
+///
+static void poolPlaceWorkers(struct pool *p, const struct poolAttr *a) {
+    int cpus[CPU_SETSIZE];
+    int nodes[CPU_SETSIZE];
+    int ncpus = 0;
+    cpu_set_t set;
+    if (!sched_getaffinity(0, sizeof(set), &set)) {
+        for (int c = 0; c < CPU_SETSIZE; c++)
+            if (CPU_ISSET(c, &set))
+                cpus[ncpus++] = c;
+    }
+    if (ncpus == 0)
+        cpus[ncpus++] = 0;
+
+    // dense node indices in order of first appearance
+    int ids[CPU_SETSIZE];
+    p->nnodes = 1;
+    if (a->numa) {
+        p->nnodes = 0;
+        for (int i = 0; i < ncpus; i++) {
+            int id = cpuNode(cpus[i]);
+            int k = 0;
+            while (k < p->nnodes && ids[k] != id)
+                k++;
+            if (k == p->nnodes)
+                ids[p->nnodes++] = id;
+            nodes[i] = k;
+        }
+    } else {
+        for (int i = 0; i < ncpus; i++)
+            nodes[i] = 0;
+    }
+
+    p->nworkers = a->nworkers > 0 ? a->nworkers : ncpus;
+    p->workers = calloc(p->nworkers, sizeof(struct poolWorker));
+    if (!p->workers) {
+        fprintf(stderr, "pool: could not allocate the workers\n");
+        exit(1);
+    }
+    for (int i = 0; i < p->nworkers; i++) {
+        struct poolWorker *w = &p->workers[i];
+        int node = i % p->nnodes;
+        int nth = i / p->nnodes;
+        int count = 0;
+        for (int k = 0; k < ncpus; k++)
+            count += nodes[k] == node;
+        nth %= count;
+        int c = 0;
+        while (nodes[c] != node || nth-- > 0)
+            c++;
+        w->node = node;
+        w->cpu = cpus[c];
     }
-    UNLOCK(p);
 }
 
 /// poolInit
 /// ========
-/// Init queue and all the semaphores.
+/// Init the pool with default attributes.
 ///
 void poolInit(struct pool *p) {
-    taskQueueInit(&p->q);
-    sem_init(&p->fcount, 0, 0);
-    sem_init(&p->ecount, 0, TASK_QUEUE_SIZE);
-    sem_init(&p->lock, 0, 1);
+    struct poolAttr a;
+    poolAttrInit(&a);
+    poolInitAttr(p, &a);
+}
+
+/// poolInitAttr
+/// ============
+/// Place the workers, init queues, worker deques and the parking
+/// primitives.
+///
+void poolInitAttr(struct pool *p, const struct poolAttr *a) {
+    poolPlaceWorkers(p, a);
+    p->q = malloc(sizeof(struct taskQueue) * p->nnodes);
+    for (int i = 0; i < p->nnodes; i++) {
+        if (!p->q || taskQueueInit(&p->q[i], a->qsize)) {
+            fprintf(stderr, "pool: could not allocate the task queue\n");
+            exit(1);
+        }
+    }
+    p->rr = 0;
+    p->mode = a->mode;
+    p->pin = a->pin;
+    for (int i = 0; i < p->nworkers; i++) {
+        struct poolWorker *w = &p->workers[i];
+        w->p = p;
+        w->seed = i + 1;
+        w->dq.tasks = NULL;
+        if (p->mode == POOL_MODE_STEALING &&
+                taskDequeInit(&w->dq, TASK_DEQUE_SIZE)) {
+            fprintf(stderr, "pool: could not allocate a worker deque\n");
+            exit(1);
+        }
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->fcond, NULL);
+    pthread_cond_init(&p->econd, NULL);
+    p->fsleepers = 0;
+    p->esleepers = 0;
+    p->shutdown = 0;
+    p->spin = a->spin;
 }
 
 /// poolFree
 /// ========
-/// Destroy queue and all the semaphores.
+/// Destroy queue, worker deques and the parking primitives.
 ///
 void poolFree(struct pool *p) {
-    sem_destroy(&p->fcount);
-    sem_destroy(&p->ecount);
-    sem_destroy(&p->lock);
-    taskQueueFree(&p->q);
+    for (int i = 0; i < p->nworkers; i++)
+        taskDequeFree(&p->workers[i].dq);
+    pthread_cond_destroy(&p->econd);
+    pthread_cond_destroy(&p->fcond);
+    pthread_mutex_destroy(&p->lock);
+    for (int i = 0; i < p->nnodes; i++)
+        taskQueueFree(&p->q[i]);
+    free(p->q);
+    free(p->workers);
+    p->q = NULL;
+    p->workers = NULL;
 }
 
 /// poolCreateWorkers
 /// =================
 /// Create all the workers in the pool.
-/// Workers will start working immediately.
+/// Workers will start working immediately, on their own CPU
+/// when pinned, else on any CPU of their node (NUMA partitioning
+/// only) or anywhere.
 ///
 void poolCreateWorkers(struct pool *p) {
-    for (int i = 0; i < ARRAYLEN(p->workers); i++)
-        pthread_create(&p->workers[i], NULL, worker, (void *)p);
+    // node of every allowed CPU (-1 for the others), read from sysfs
+    // once for all the workers
+    int nodes[CPU_SETSIZE];
+    int numa = !p->pin && p->nnodes > 1;
+    if (numa) {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        sched_getaffinity(0, sizeof(allowed), &allowed);
+        for (int c = 0; c < CPU_SETSIZE; c++)
+            nodes[c] = CPU_ISSET(c, &allowed) ? cpuNode(c) : -1;
+    }
+    for (int i = 0; i < p->nworkers; i++) {
+        struct poolWorker *w = &p->workers[i];
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (p->pin) {
+            CPU_SET(w->cpu, &set);
+        } else if (numa && nodes[w->cpu] >= 0) {
+            for (int c = 0; c < CPU_SETSIZE; c++)
+                if (nodes[c] == nodes[w->cpu])
+                    CPU_SET(c, &set);
+        }
+        if (CPU_COUNT(&set) > 0)
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        pthread_create(&w->thread, &attr, worker, (void *)w);
+        pthread_attr_destroy(&attr);
+    }
 }
 
 /// poolShutdown
 /// ============
 /// Let workers know we have to shutdown. 
 /// This is not a immediate shutdown. Before the exit,
-/// Workers will finish all the work they are currently doing.
-/// Here poolShutdown will trigger extra ARRAYLEN(p->workers)
-/// (number of threads) increments to fill count to wake up the
-/// sleeping workers.
+/// Workers will finish all the tasks left in the queue.
+/// Here poolShutdown sets the shutdown flag and wakes up
+/// every parked worker so it can notice it.
 ///
 void poolShutdown(struct pool *p) {
-    for (int i = 0; i < ARRAYLEN(p->workers); i++)
-        FILLCOUNT_UP(p);
+    pthread_mutex_lock(&p->lock);
+    STORE(p->shutdown, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&p->fcond);
+    pthread_mutex_unlock(&p->lock);
 }
 
 /// poolDestroyWorkers
@@ -140,28 +535,134 @@ void poolShutdown(struct pool *p) {
 /// is shutdown.
 ///
 void poolDestroyWorkers(struct pool *p) {
-    for (int i = 0; i < ARRAYLEN(p->workers); i++)
-        pthread_join(p->workers[i], NULL);
+    for (int i = 0; i < p->nworkers; i++)
+        pthread_join(p->workers[i].thread, NULL);
 }
 
 /// poolAddTask
 /// ===========
-/// Add a new task to the queue.
-/// 1. Decrement the empty count.
-/// 2. Enter the critical section.
-/// 3. Add the new task.
-/// 4. Leave the critical section.
-/// 5. increment the fill count. 
-///
-/// If the empty count is 0 that means the task queue is full.
-/// poolAddTask will wait at this point until any of the workers
-/// pick a task from the queue.
+/// Add a new task to the queue of the calling worker's node, or
+/// round robin over the nodes when called from outside the pool.
 ///
 void poolAddTask(struct pool *p, struct task t) {
-    EMPTYCOUNT_DOWN(p);
-    LOCK(p);
-    taskQueueEnqueue(&p->q, t);
-    UNLOCK(p);
-    FILLCOUNT_UP(p);
+    poolAddTaskNode(p, t, -1);
 }
 
+/// poolAddTaskNode
+/// ===============
+/// Add a new task to the queue of @node (-1 for any).
+/// 1. Try to enqueue, spinning for a while if the queue is full.
+/// 2. If it is still full, park until a worker takes a task.
+/// 3. Wake up a parked worker, if any.
+///
+/// If the task has a wait group, it is counted there before
+/// it can possibly run.
+///
+/// In stealing mode a task added from inside a task of the same
+/// pool, for the calling worker's node, goes to the deque of that
+/// worker instead. If that deque is full the task is run right
+/// away; parking a worker on its own pool could deadlock.
+///
+void poolAddTaskNode(struct pool *p, struct task t, int node) {
+    if (t.wg)
+        waitGroupAdd(t.wg, 1);
+    int inside = self && self->p == p;
+    if (p->mode == POOL_MODE_STEALING && inside &&
+            (node < 0 || node % p->nnodes == self->node)) {
+        if (taskDequePush(&self->dq, t))
+            WAKE_WORKER(p);
+        else
+            runTask(t);
+        return;
+    }
+    if (node < 0)
+        node = inside ? self->node
+                : (int)(__atomic_fetch_add(&p->rr, 1, __ATOMIC_RELAXED) % p->nnodes);
+    struct taskQueue *q = &p->q[node % p->nnodes];
+    for (int i = 0; i < p->spin; i++) {
+        if (taskQueueEnqueue(q, t))
+            goto added;
+        CPU_RELAX();
+    }
+    pthread_mutex_lock(&p->lock);
+    __atomic_add_fetch(&p->esleepers, 1, __ATOMIC_SEQ_CST);
+    FENCE();
+    while (!taskQueueEnqueue(q, t))
+        pthread_cond_wait(&p->econd, &p->lock);
+    __atomic_sub_fetch(&p->esleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&p->lock);
+added:
+    WAKE_WORKER(p);
+}
+
+/// poolWorkerCount
+/// ===============
+/// Number of workers in the pool.
+///
+int poolWorkerCount(struct pool *p) {
+    return p->nworkers;
+}
+
+/// poolNodeCount
+/// =============
+/// Number of nodes (task queues) in the pool, 1 unless the
+/// pool was created with NUMA partitioning.
+///
+int poolNodeCount(struct pool *p) {
+    return p->nnodes;
+}
+
+/// waitGroupInit
+/// =============
+/// Init an empty wait group.
+///
+void waitGroupInit(struct waitGroup *wg) {
+    pthread_mutex_init(&wg->lock, NULL);
+    pthread_cond_init(&wg->cond, NULL);
+    wg->n = 0;
+}
+
+/// waitGroupFree
+/// =============
+/// Destroy the wait group. No task may still be counted in it.
+///
+void waitGroupFree(struct waitGroup *wg) {
+    pthread_cond_destroy(&wg->cond);
+    pthread_mutex_destroy(&wg->lock);
+}
+
+/// waitGroupAdd
+/// ============
+/// Count @n more unfinished tasks. poolAddTask does this
+/// for tasks that have a wait group.
+///
+void waitGroupAdd(struct waitGroup *wg, int n) {
+    pthread_mutex_lock(&wg->lock);
+    wg->n += n;
+    pthread_mutex_unlock(&wg->lock);
+}
+
+/// waitGroupDone
+/// =============
+/// Mark one task finished and wake up the waiters
+/// when it was the last one.
+///
+void waitGroupDone(struct waitGroup *wg) {
+    pthread_mutex_lock(&wg->lock);
+    if (--wg->n == 0)
+        pthread_cond_broadcast(&wg->cond);
+    pthread_mutex_unlock(&wg->lock);
+}
+
+/// waitGroupWait
+/// =============
+/// Block until every task counted in the wait group is done.
+/// The pool keeps running, so the wait group can be reused
+/// for the next batch right away.
+///
+void waitGroupWait(struct waitGroup *wg) {
+    pthread_mutex_lock(&wg->lock);
+    while (wg->n > 0)
+        pthread_cond_wait(&wg->cond, &wg->lock);
+    pthread_mutex_unlock(&wg->lock);
+}
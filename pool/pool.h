@@ -23,63 +23,190 @@
 #ifndef POOL_H
 #define POOL_H
 
+#include <stddef.h>
 #include <pthread.h>
-#include <semaphore.h>
 
 typedef void (*taskFn)(void *);
 
+/// waitGroup
+/// =========
+/// Counter of unfinished tasks of one batch.
+/// @lock: Mutex protecting @n.
+/// @cond: Signalled when @n drops to 0.
+/// @n: Number of unfinished tasks.
+struct waitGroup {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int n;
+};
+
 /// task
 /// ====
 /// @fn: task function.
 /// @arg: Arguments of the @fn.
+/// @wg: Wait group the task belongs to, or NULL.
 struct task {
     taskFn fn;
     void *arg; 
+    struct waitGroup *wg;
 };
 
-/// Max number of tasks, task queue can hold.
-#define TASK_QUEUE_SIZE 16
+/// Default number of tasks the task queue can hold.
+#define TASK_QUEUE_SIZE 1024
+
+/// Default number of spins before a waiting thread parks.
+#define POOL_SPIN 128
+
+/// taskSlot
+/// ========
+/// @seq: Sequence number telling whether the slot is free
+///       or full for the current lap of the ring.
+/// @task: Stored task.
+struct taskSlot {
+    size_t seq;
+    struct task task;
+};
 
 /// taskQueue
 /// =========
-/// @tasks: Tasks array.
-/// @head: Queue head position.
-/// @tail: Queue tail position.
-/// @n: Number of tasks in queue.
+/// Bounded lock-free multi-producer multi-consumer ring.
+/// @slots: Slots array of @mask + 1 (a power of two) entries.
+/// @mask: Capacity - 1.
+/// @head: Next position to dequeue.
+/// @tail: Next position to enqueue.
+///
+/// @head and @tail live on their own cache lines so producers
+/// and consumers do not bounce a line between them.
 struct taskQueue {
-    struct task tasks[TASK_QUEUE_SIZE];
-    int head;
-    int tail;
-    int n;
+    struct taskSlot *slots;
+    size_t mask;
+    size_t head __attribute__((aligned(64)));
+    size_t tail __attribute__((aligned(64)));
 };
 
-/// Number of workers (threads) in the thread pool.
-#define POOL_WORKER_SIZE 4
+/// Number of tasks a worker deque can hold.
+#define TASK_DEQUE_SIZE 1024
+
+/// taskDeque
+/// =========
+/// Chase-Lev work-stealing deque of one worker. The owner pushes
+/// and takes at @bottom, thieves steal at @top.
+/// @tasks: Tasks array of @mask + 1 (a power of two) entries.
+/// @mask: Capacity - 1.
+/// @top: Next position to steal.
+/// @bottom: Next position to push.
+struct taskDeque {
+    struct task *tasks;
+    long mask;
+    long top __attribute__((aligned(64)));
+    long bottom __attribute__((aligned(64)));
+};
+
+/// Scheduling modes.
+/// POOL_MODE_SHARED: Every worker takes from the shared queue.
+/// POOL_MODE_STEALING: Every worker has its own deque. Tasks added
+///     from inside a task go to the deque of the calling worker,
+///     idle workers steal from a random victim.
+enum poolMode {
+    POOL_MODE_SHARED,
+    POOL_MODE_STEALING
+};
+
+/// poolAttr
+/// ========
+/// @nworkers: Number of workers, 0 for one per CPU the process
+///            may run on.
+/// @qsize: Task queue capacity, rounded up to a power of two.
+/// @spin: Number of spins before a waiting thread parks.
+/// @mode: Scheduling mode.
+/// @pin: Pin every worker to one CPU.
+/// @numa: Give every NUMA node its own task queue and spread the
+///        workers over the nodes. Workers serve their own node's
+///        queue first and stay on that node's CPUs.
+struct poolAttr {
+    int nworkers;
+    int qsize;
+    int spin;
+    enum poolMode mode;
+    int pin;
+    int numa;
+};
+
+struct pool;
+
+/// poolWorker
+/// ==========
+/// @thread: Thread of the worker.
+/// @dq: Own deque (POOL_MODE_STEALING only).
+/// @p: Pool the worker belongs to.
+/// @seed: Random state used to pick victims.
+/// @cpu: CPU of the worker, it runs only there when pinned.
+/// @node: Index of the node (task queue) of the worker.
+struct poolWorker {
+    pthread_t thread;
+    struct taskDeque dq;
+    struct pool *p;
+    unsigned int seed;
+    int cpu;
+    int node;
+};
 
 /// pool
 /// ====
-/// @fcount: Fill count semaphore.
-/// @ecount: Empty count semaphore.
-/// @lock: Locking semaphore for mutual execution.
-/// @q: Task queue.
+/// @q: Task queues, one per node.
+/// @nnodes: Number of nodes (1 unless poolAttr.numa is set).
+/// @rr: Round robin counter spreading outside tasks over nodes.
+/// @lock: Mutex used only to park and wake up threads.
+/// @fcond: Workers park here while the queue is empty.
+/// @econd: Producers park here while the queue is full.
+/// @fsleepers: Number of parked workers.
+/// @esleepers: Number of parked producers.
+/// @shutdown: Set by poolShutdown.
+/// @spin: Number of spins before parking.
+/// @mode: Scheduling mode.
+/// @pin: Workers are pinned to their CPU.
 /// @workers: Working threads of the pool.
+/// @nworkers: Number of workers.
 struct pool {
-    sem_t fcount;
-    sem_t ecount;
-    sem_t lock;
-    struct taskQueue q;
-    pthread_t workers[POOL_WORKER_SIZE];
+    struct taskQueue *q;
+    int nnodes;
+    unsigned int rr;
+    pthread_mutex_t lock;
+    pthread_cond_t fcond;
+    pthread_cond_t econd;
+    int fsleepers;
+    int esleepers;
+    int shutdown;
+    int spin;
+    enum poolMode mode;
+    int pin;
+    struct poolWorker *workers;
+    int nworkers;
 };
 
 /// ========
 /// Main API
 /// ========
+void poolAttrInit(struct poolAttr *a);
 void poolInit(struct pool *p);
+void poolInitAttr(struct pool *p, const struct poolAttr *a);
 void poolFree(struct pool *p);
 void poolCreateWorkers(struct pool *p);
 void poolShutdown(struct pool *p);
 void poolDestroyWorkers(struct pool *p);
 void poolAddTask(struct pool *p, struct task t);
+void poolAddTaskNode(struct pool *p, struct task t, int node);
+int poolWorkerCount(struct pool *p);
+int poolNodeCount(struct pool *p);
+
+/// ===============
+/// Wait groups API
+/// ===============
+void waitGroupInit(struct waitGroup *wg);
+void waitGroupFree(struct waitGroup *wg);
+void waitGroupAdd(struct waitGroup *wg, int n);
+void waitGroupDone(struct waitGroup *wg);
+void waitGroupWait(struct waitGroup *wg);
 
 #endif
 
@@ -0,0 +1,61 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <assert.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "../pool.h"
+
+/// Pinned, NUMA partitioned pool sized to the allowed CPUs.
+/// Every task checks it runs on an allowed CPU; tasks are
+/// submitted to every node.
+#define NTASKS 4000
+
+cpu_set_t allowed;
+long bad = 0;
+long done = 0;
+
+void cpuTask(void *arg) {
+    int cpu = sched_getcpu();
+    if (cpu < 0 || !CPU_ISSET(cpu, &allowed))
+        __atomic_fetch_add(&bad, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&done, 1, __ATOMIC_RELAXED);
+}
+
+int main(int argc, char **argv) {
+    struct pool p;
+    struct waitGroup wg;
+    struct poolAttr a;
+
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    poolAttrInit(&a);
+    a.pin = 1;
+    a.numa = 1;
+    poolInitAttr(&p, &a);
+    assert(poolWorkerCount(&p) == CPU_COUNT(&allowed));
+    assert(poolNodeCount(&p) >= 1);
+    waitGroupInit(&wg);
+    poolCreateWorkers(&p);
+
+    for (int i = 0; i < NTASKS; i++) {
+        struct task t = {.fn = cpuTask, .arg = NULL, .wg = &wg};
+        poolAddTaskNode(&p, t, i % poolNodeCount(&p));
+    }
+    waitGroupWait(&wg);
+    assert(done == NTASKS);
+    assert(bad == 0);
+
+    poolShutdown(&p);
+    poolDestroyWorkers(&p);
+    waitGroupFree(&wg);
+    poolFree(&p);
+
+    // explicit size, more workers than CPUs
+    poolAttrInit(&a);
+    a.nworkers = 3;
+    a.pin = 1;
+    poolInitAttr(&p, &a);
+    assert(poolWorkerCount(&p) == 3);
+    poolFree(&p);
+    return 0;
+}
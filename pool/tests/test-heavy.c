@@ -1,5 +1,173 @@
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdlib.h>
+#include <semaphore.h>
+
 #include "../pool.h"
 
+#define TASK_COUNT 10000
+
+/// Tiny tasks for the throughput run. They do almost nothing,
+/// so the time is spent in the queue itself.
+#define TINY_TASK_COUNT 1000000
+
+int left = TASK_COUNT;
+long tinyDone = 0;
+
+pthread_mutex_t lock;
+
+void fakeTask(void *arg) {
+    usleep(100);
+    pthread_mutex_lock(&lock);
+    left -= 1;
+    pthread_mutex_unlock(&lock);
+}
+
+void tinyTask(void *arg) {
+    __atomic_fetch_add(&tinyDone, 1, __ATOMIC_RELAXED);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void runHeavy() {
+    struct pool p; 
+    poolInit(&p);
+    poolCreateWorkers(&p);
+    for (int i = 0; i < TASK_COUNT; i++) {
+        struct task t = {.fn = fakeTask, .arg = NULL};
+        poolAddTask(&p, t);
+    }
+    poolShutdown(&p);
+    poolDestroyWorkers(&p);
+    poolFree(&p);
+
+    assert(left == 0);
+}
+
+/// ringPool
+/// ========
+/// The pool before the lock-free queue, kept as the baseline of the
+/// throughput run: a ring of RING_SIZE tasks guarded by a binary
+/// semaphore, with fill and empty count semaphores.
+#define RING_SIZE 16
+
+struct ringPool {
+    sem_t fcount;
+    sem_t ecount;
+    sem_t lock;
+    struct task tasks[RING_SIZE];
+    int head;
+    int tail;
+    int n;
+    pthread_t *workers;
+    int nworkers;
+};
+
+static void *ringWorker(void *arg) {
+    struct ringPool *r = arg;
+    while (1) {
+        sem_wait(&r->fcount);
+        sem_wait(&r->lock);
+        if (r->n == 0)
+            break;
+        struct task t = r->tasks[r->head];
+        r->head = (r->head + 1) % RING_SIZE;
+        r->n--;
+        sem_post(&r->lock);
+        sem_post(&r->ecount);
+        (*t.fn)(t.arg);
+    }
+    sem_post(&r->lock);
+    return NULL;
+}
+
+static void ringAddTask(struct ringPool *r, struct task t) {
+    sem_wait(&r->ecount);
+    sem_wait(&r->lock);
+    r->tasks[r->tail] = t;
+    r->tail = (r->tail + 1) % RING_SIZE;
+    r->n++;
+    sem_post(&r->lock);
+    sem_post(&r->fcount);
+}
+
+/// Seconds the ring takes for the tiny tasks on nworkers threads.
+static double ringThroughput(int nworkers) {
+    struct ringPool r = {.head = 0, .tail = 0, .n = 0};
+    sem_init(&r.fcount, 0, 0);
+    sem_init(&r.ecount, 0, RING_SIZE);
+    sem_init(&r.lock, 0, 1);
+    r.nworkers = nworkers;
+    r.workers = malloc(sizeof(pthread_t) * nworkers);
+    assert(r.workers);
+    for (int i = 0; i < nworkers; i++)
+        pthread_create(&r.workers[i], NULL, ringWorker, &r);
+
+    tinyDone = 0;
+    double start = now();
+    for (int i = 0; i < TINY_TASK_COUNT; i++) {
+        struct task t = {.fn = tinyTask, .arg = NULL};
+        ringAddTask(&r, t);
+    }
+    for (int i = 0; i < nworkers; i++)
+        sem_post(&r.fcount);
+    for (int i = 0; i < nworkers; i++)
+        pthread_join(r.workers[i], NULL);
+    double elapsed = now() - start;
+
+    free(r.workers);
+    sem_destroy(&r.fcount);
+    sem_destroy(&r.ecount);
+    sem_destroy(&r.lock);
+    assert(tinyDone == TINY_TASK_COUNT);
+    return elapsed;
+}
+
+/// Seconds the pool takes for the tiny tasks, its worker count in
+/// nworkers.
+static double poolThroughput(int *nworkers) {
+    struct pool p; 
+    poolInit(&p);
+    poolCreateWorkers(&p);
+    *nworkers = poolWorkerCount(&p);
+    tinyDone = 0;
+    double start = now();
+    for (int i = 0; i < TINY_TASK_COUNT; i++) {
+        struct task t = {.fn = tinyTask, .arg = NULL};
+        poolAddTask(&p, t);
+    }
+    poolShutdown(&p);
+    poolDestroyWorkers(&p);
+    double elapsed = now() - start;
+    poolFree(&p);
+
+    assert(tinyDone == TINY_TASK_COUNT);
+    return elapsed;
+}
+
+static void runThroughput() {
+    int nworkers;
+    double queue = poolThroughput(&nworkers);
+    double ring = ringThroughput(nworkers);
+    printf("throughput: %d tiny tasks on %d workers\n",
+        TINY_TASK_COUNT, nworkers);
+    printf("  semaphore ring: %.3f s (%.0f tasks/s)\n",
+        ring, TINY_TASK_COUNT / ring);
+    printf("  lock-free pool: %.3f s (%.0f tasks/s), %.1fx\n",
+        queue, TINY_TASK_COUNT / queue, ring / queue);
+}
+
 int main(int argc, char **argv) {
+    pthread_mutex_init(&lock, NULL);
+    runHeavy();
+    runThroughput();
+    pthread_mutex_destroy(&lock);
     return 0;
 }
@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "../pool.h"
+
+/// Every task spawns two children from inside the pool until
+/// DEPTH, so all but the root go through the worker deques.
+#define DEPTH 17
+
+struct pool p;
+struct waitGroup wg;
+long done = 0;
+
+void treeTask(void *arg) {
+    long depth = (long)arg;
+    if (depth < DEPTH) {
+        for (int i = 0; i < 2; i++) {
+            struct task t = {.fn = treeTask, .arg = (void *)(depth + 1), .wg = &wg};
+            poolAddTask(&p, t);
+        }
+    }
+    __atomic_fetch_add(&done, 1, __ATOMIC_RELAXED);
+}
+
+int main(int argc, char **argv) {
+    struct poolAttr a;
+    poolAttrInit(&a);
+    a.mode = POOL_MODE_STEALING;
+    a.nworkers = 4;
+    poolInitAttr(&p, &a);
+    waitGroupInit(&wg);
+    poolCreateWorkers(&p);
+
+    for (int run = 1; run <= 3; run++) {
+        struct task t = {.fn = treeTask, .arg = (void *)1L, .wg = &wg};
+        poolAddTask(&p, t);
+        waitGroupWait(&wg);
+        assert(done == run * ((1L << DEPTH) - 1));
+    }
+
+    poolShutdown(&p);
+    poolDestroyWorkers(&p);
+    waitGroupFree(&wg);
+    poolFree(&p);
+    return 0;
+}
@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "../pool.h"
+
+#define TASK_COUNT 1000
+#define BATCH_COUNT 5
+
+int done = 0;
+
+pthread_mutex_t lock;
+
+void countTask(void *arg) {
+    usleep(10);
+    pthread_mutex_lock(&lock);
+    done += 1;
+    pthread_mutex_unlock(&lock);
+}
+
+int main(int argc, char **argv) {
+    pthread_mutex_init(&lock, NULL);
+
+    struct pool p; 
+    struct waitGroup wg;
+    poolInit(&p);
+    waitGroupInit(&wg);
+    poolCreateWorkers(&p);
+    for (int b = 1; b <= BATCH_COUNT; b++) {
+        for (int i = 0; i < TASK_COUNT; i++) {
+            struct task t = {.fn = countTask, .arg = NULL, .wg = &wg};
+            poolAddTask(&p, t);
+        }
+        waitGroupWait(&wg);
+        assert(done == b * TASK_COUNT);
+    }
+    poolShutdown(&p);
+    poolDestroyWorkers(&p);
+    waitGroupFree(&wg);
+    poolFree(&p);
+
+    pthread_mutex_destroy(&lock);
+    return 0;
+}
@@ -1,12 +1,25 @@
 #include <cmath>
+#include <climits>
+#include <numeric>
+#include <algorithm>
+#include <memory>
 #include <iostream>
 #include <diplib.h>
 #include <diplib/linear.h>
-#include <diplib/analysis.h>
+#include <diplib/geometry.h>
 #include <diplib/simple_file_io.h>
-#include <xtensor/xarray.hpp>
-#include <xtensor-blas/xlinalg.hpp>
 #include "snake.h"
+#include "internal.h"
+#include "force.h"
+#include "gauss.h"
+#include "gvf.h"
+#include "cache.h"
+extern "C" {
+#include "pool/pool.h"
+#ifdef SNAKE_OPENCL
+#include "clapi.h"
+#endif
+}
 
 #define SNAKE_DEBUG 1
 
@@ -28,6 +41,17 @@ EXTERNC void imageRead(struct image *im, const char *filename) {
     dip::ImageRead(im->dip_img, std::string(filename));
 }
 
+EXTERNC void imageSetData(
+        struct image *im,
+        const float *data,
+        int width,
+        int height) {
+    dip::uint w = width;
+    dip::uint h = height;
+    im->dip_img = dip::Image({ w, h }, 1, dip::DT_SFLOAT);
+    std::copy(data, data + w * h, (float *) im->dip_img.Origin());
+}
+
 EXTERNC unsigned char *imageGetData(struct image *im) {
     return (unsigned char *) im->dip_img.Data();
 }
@@ -57,7 +81,7 @@ EXTERNC struct contour *contourNew() {
 
 EXTERNC void contourInit(struct contour *con, int size = 1024) {
     con->x.resize(size);
-    con->x.resize(size);
+    con->y.resize(size);
 }
 
 EXTERNC void contourPush(struct contour *con, double x, double y) {
@@ -80,14 +104,27 @@ EXTERNC int contourSize(struct contour *con) {
     return con->x.size();
 }
 
+EXTERNC void contourGetPoint(
+        struct contour *con,
+        int i,
+        double *x,
+        double *y) {
+    *x = con->x[i];
+    *y = con->y[i];
+}
+
 EXTERNC void contourFree(struct contour *con) {
     delete con;
 }
 
 // Energy API
 // ========================================================
+// levels[l] is the force of the image downsampled l times by two,
+// levels[0] is field itself. New fields are stored as type.
 struct energy {
-    dip::Image dip_force; 
+    std::shared_ptr<const struct forceField> field;
+    std::vector<std::shared_ptr<const struct forceField>> levels;
+    enum snakeForceType type;
 };
 
 EXTERNC struct energy *energyNew() {
@@ -95,15 +132,230 @@ EXTERNC struct energy *energyNew() {
 }
 
 EXTERNC void energyInit(struct energy *en) {
-    en->dip_force = dip::Image();
+    en->field.reset();
+    en->levels.clear();
+    en->type = SNAKE_FORCE_FLOAT32;
+}
+
+EXTERNC void energySetForceType(
+        struct energy *en,
+        enum snakeForceType type) {
+    en->type = type;
+}
+
+// Copy of the image as a flat float buffer, made through a protected
+// dip::Image view on it.
+static std::vector<float> imageToFloat(const dip::Image& img) {
+    dip::uint w = img.Sizes()[0];
+    dip::uint h = img.Sizes()[1];
+    std::vector<float> pixels(w * h);
+    float *src = pixels.data();
+    dip::Image view(
+        dip::NonOwnedRefToDataSegment(src),
+        src,
+        dip::DT_SFLOAT,
+        { w, h },
+        { 1, (dip::sint) w },
+        dip::Tensor(),
+        1);
+    view.Protect();
+    view.Copy(img);
+    return pixels;
+}
+
+// The recursive pipeline (gauss.h) writes the force straight into the
+// tiles of a new field. Snakes holding the old field keep it.
+static std::shared_ptr<struct forceField> forceFromImage(
+        const dip::Image& img,
+        double sigma,
+        enum snakeForceType type,
+        struct pool *p) {
+    int w = img.Sizes()[0];
+    int h = img.Sizes()[1];
+    std::vector<float> pixels = imageToFloat(img);
+    std::shared_ptr<struct forceField> field = std::make_shared<forceField>();
+    forceFieldInit(*field, w, h, type);
+    gaussForce(pixels.data(), w, h, sigma, *field, p);
+    return field;
 }
 
 EXTERNC void energyCalculateForce(
         struct energy *en, 
         struct image *im, 
         double sigma) {
-    dip::GradientMagnitude(im->dip_img, en->dip_force, { sigma });
-    dip::Gradient(en->dip_force, en->dip_force);
+    energyCalculateForcePool(en, im, sigma, NULL);
+}
+
+EXTERNC void energyCalculateForcePool(
+        struct energy *en,
+        struct image *im,
+        double sigma,
+        struct pool *p) {
+    en->field = forceFromImage(im->dip_img, sigma, en->type, p);
+    en->levels.assign(1, en->field);
+}
+
+// Only keeps a float copy of the image; every block of the force is
+// computed when a snake first samples it (force.h, lazy fields).
+EXTERNC void energyCalculateForceLazy(
+        struct energy *en,
+        struct image *im,
+        double sigma) {
+    int w = imageWidth(im);
+    int h = imageHeight(im);
+    std::shared_ptr<struct forceField> field = std::make_shared<forceField>();
+    forceFieldInitLazy(
+        *field,
+        imageToFloat(im->dip_img),
+        w,
+        h,
+        sigma,
+        en->type);
+    en->field = field;
+    en->levels.assign(1, en->field);
+}
+
+// Map the field of key (hash, sigma) from the cache file path into en
+// when it is there, otherwise compute it with calculate(field, pixels)
+// and store it. Returns 1 on a hit.
+template <typename F>
+static int energyLoadOrCalculate(
+        struct energy *en,
+        const std::vector<float>& pixels,
+        int w,
+        int h,
+        uint64_t hash,
+        double sigma,
+        const std::string& path,
+        F calculate) {
+    std::shared_ptr<struct forceField> field = std::make_shared<forceField>();
+    bool hit = cacheLoad(path.c_str(), hash, sigma, en->type, *field);
+    if (!hit) {
+        forceFieldInit(*field, w, h, en->type);
+        calculate(*field, pixels.data());
+        cacheStore(path.c_str(), hash, sigma, *field);
+    }
+    en->field = field;
+    en->levels.assign(1, en->field);
+    return hit;
+}
+
+EXTERNC int energyLoadOrCalculateForce(
+        struct energy *en,
+        struct image *im,
+        double sigma,
+        const char *dir) {
+    return energyLoadOrCalculateForcePool(en, im, sigma, dir, NULL);
+}
+
+EXTERNC int energyLoadOrCalculateForcePool(
+        struct energy *en,
+        struct image *im,
+        double sigma,
+        const char *dir,
+        struct pool *p) {
+    int w = imageWidth(im);
+    int h = imageHeight(im);
+    std::vector<float> pixels = imageToFloat(im->dip_img);
+    uint64_t hash = cacheHash(pixels.data(), w, h);
+    std::string path = cachePath(dir, hash, sigma, en->type);
+    return energyLoadOrCalculate(en, pixels, w, h, hash, sigma, path,
+        [&](struct forceField& field, const float *img) {
+            gaussForce(img, w, h, sigma, field, p);
+        });
+}
+
+EXTERNC void energyCalculateGVF(
+        struct energy *en,
+        struct image *im,
+        double sigma,
+        double mu,
+        int niter) {
+    energyCalculateGVFPool(en, im, sigma, mu, niter, NULL);
+}
+
+EXTERNC void energyCalculateGVFPool(
+        struct energy *en,
+        struct image *im,
+        double sigma,
+        double mu,
+        int niter,
+        struct pool *p) {
+    int w = imageWidth(im);
+    int h = imageHeight(im);
+    std::vector<float> pixels = imageToFloat(im->dip_img);
+    std::shared_ptr<struct forceField> field = std::make_shared<forceField>();
+    forceFieldInit(*field, w, h, en->type);
+    gvfForce(pixels.data(), w, h, sigma, mu, niter, *field, p);
+    en->field = field;
+    en->levels.assign(1, en->field);
+}
+
+EXTERNC int energyLoadOrCalculateGVF(
+        struct energy *en,
+        struct image *im,
+        double sigma,
+        double mu,
+        int niter,
+        const char *dir) {
+    return energyLoadOrCalculateGVFPool(en, im, sigma, mu, niter, dir, NULL);
+}
+
+EXTERNC int energyLoadOrCalculateGVFPool(
+        struct energy *en,
+        struct image *im,
+        double sigma,
+        double mu,
+        int niter,
+        const char *dir,
+        struct pool *p) {
+    int w = imageWidth(im);
+    int h = imageHeight(im);
+    std::vector<float> pixels = imageToFloat(im->dip_img);
+    uint64_t hash = cacheHashGVF(cacheHash(pixels.data(), w, h), mu, niter);
+    std::string path = cachePathGVF(dir, hash, sigma, mu, niter, en->type);
+    return energyLoadOrCalculate(en, pixels, w, h, hash, sigma, path,
+        [&](struct forceField& field, const float *img) {
+            gvfForce(img, w, h, sigma, mu, niter, field, p);
+        });
+}
+
+/// Smallest image side a pyramid level may have.
+#define ENERGY_PYRAMID_MIN_SIZE 32
+
+// Force pyramid. Every level halves the image (after a small
+// anti-alias blur) and sigma, so a level sees the same structures
+// as the full image at a quarter of the cost of the one above it.
+// The force is a second derivative, so on level l it comes out 4^l
+// times stronger per level pixel; it is scaled back so one gamma
+// moves a snake by about the same number of level pixels on every
+// level. Levels stop early when the image gets too small.
+EXTERNC void energyCalculatePyramid(
+        struct energy *en,
+        struct image *im,
+        double sigma,
+        int nlevels) {
+    energyCalculateForce(en, im, sigma);
+    dip::Image img = im->dip_img;
+    for (int l = 1; l < nlevels; l++) {
+        if (std::min(img.Sizes()[0], img.Sizes()[1]) / 2 <
+                ENERGY_PYRAMID_MIN_SIZE)
+            break;
+        dip::Image smooth;
+        dip::Gauss(img, smooth, { 1.0 });
+        dip::Image half;
+        dip::Resampling(smooth, half, { 0.5 }, { 0.0 }, "linear");
+        img = half;
+
+        std::shared_ptr<struct forceField> field =
+            forceFromImage(img, std::ldexp(sigma, -l), en->type, NULL);
+        forceFieldScale(*field, std::ldexp(1.0, -2 * l));
+        en->levels.push_back(field);
+    }
+}
+
+EXTERNC int energyLevels(struct energy *en) {
+    return en->levels.size();
 }
 
 EXTERNC void energyFree(struct energy *en) {
@@ -126,153 +378,922 @@ void utilShowImagePixels(const dip::Image& im) {
 
 // Snake API
 // ========================================================
+// The contour of a snake is kept in double (struct contour), while an
+// exec runs in the precision of the snake: snakeState<T> holds the
+// operator and scratch space of one precision, only the one in use is
+// filled.
+template <typename T>
+struct snakeState {
+    std::shared_ptr<const struct internal<T>> mat;
+    struct internalWork<T> work;
+};
+
 struct snake {
-    std::vector<double> mat;
-    struct image im;
+    struct snakeState<double> f64;
+    struct snakeState<float> f32;
     struct contour con;
-    struct energy exteng;
+    std::shared_ptr<const struct forceField> field;
     double alpha;
     double beta;
     double gamma;
+    enum snakeEngine engine;
+    enum snakePrecision precision;
+    enum snakeNorm norm;
+    double tol;
+    int resample;
+    double spacing;
+    std::vector<std::shared_ptr<const struct forceField>> levels;
 };
 
 EXTERNC struct snake *snakeNew() {
     return new snake();
 }
 
-static void fillMatrixSnake(struct snake& snake) {
-    double a = snake.gamma * (2 * snake.alpha + 6 * snake.beta) + 1;
-    double b = snake.gamma * (-snake.alpha - 4 * snake.beta);
-    double c = snake.gamma * snake.beta;
-    int n = contourSize(&snake.con);
-    for (int i = 0; i < n; i++) {
-        int in2 = ((i - 2) < 0) ? n + (i - 2) : (i - 2);
-        int in1 = ((i - 1) < 0) ? n + (i - 1) : (i - 1);
-        int ip1 = (i + 1) % n;
-        int ip2 = (i + 2) % n;
-        for (int j = 0; j < n; j++) {
-            if (in2 == j)
-                snake.mat[i * n + j] = c;
-            else if (in1 == j)
-                snake.mat[i * n + j] = b;
-            else if (i == j)
-                snake.mat[i * n + j] = a;
-            else if (ip1 == j)
-                snake.mat[i * n + j] = b;
-            else if (ip2 == j)
-                snake.mat[i * n + j] = c;
-            else
-                snake.mat[i * n + j] = 0.0;
-        }
-    }
-    std::vector<size_t> shape = { (size_t) n, (size_t) n };
-    xt::xarray<double, xt::layout_type::dynamic> mat(shape, 
-            xt::layout_type::row_major);
-    for (int i = 0; i < n * n; i++)
-        mat.data()[i] = snake.mat[i];
-    mat = xt::linalg::inv(mat);
-    for (int i = 0; i < n * n; i++)
-        snake.mat[i] = mat.data()[i];
+// Point the state of the precision in use at the operator of n
+// points and drop the other one.
+static void snakeOperator(struct snake *snake, int n) {
+    snake->f64.mat.reset();
+    snake->f32.mat.reset();
+    if (n < SNAKE_MIN_POINTS)
+        return;
+    if (snake->precision == SNAKE_PRECISION_FLOAT32)
+        snake->f32.mat = internalGet<float>(
+            snake->engine,
+            snake->alpha,
+            snake->beta,
+            snake->gamma,
+            n);
+    else
+        snake->f64.mat = internalGet<double>(
+            snake->engine,
+            snake->alpha,
+            snake->beta,
+            snake->gamma,
+            n);
 }
 
-EXTERNC void snakeSetContour(struct snake *snake, struct contour *con) {
-    int n = contourSize(con);
-    snake->mat.resize(n * n);
-    fillMatrixSnake(*snake);
+EXTERNC int snakeSetContour(struct snake *snake, struct contour *con) {
+    if (contourSize(con) < SNAKE_MIN_POINTS)
+        return -1;
+    snake->con = *con;
+    snakeOperator(snake, contourSize(con));
+    return 0;
 }
 
 EXTERNC struct contour *snakeGetContour(struct snake *snake) {
     return &snake->con;
 }
 
-EXTERNC void snakeInit(
+EXTERNC int snakeInit(
         struct snake *snake, 
-        struct image *im, 
         struct contour *con, 
         struct energy *en,
         double alpha,
         double beta,
-        double gamma) {
-    snake->im = *im;
-    snake->con = *con;
-    snake->exteng = *en;
+        double gamma,
+        enum snakeEngine engine) {
+    snake->field = en->field;
+    snake->levels = en->levels;
     snake->alpha = alpha;
     snake->beta = beta;
     snake->gamma = gamma;
-    snakeSetContour(snake, con);
+    snake->engine = engine;
+    snake->precision = SNAKE_PRECISION_FLOAT64;
+    snake->norm = SNAKE_NORM_MAX;
+    snake->tol = 0;
+    snake->resample = 0;
+    snake->spacing = 0;
+    snake->con = contour();
+    snakeOperator(snake, 0);
+    return snakeSetContour(snake, con);
 }
 
-static double getForceOnPointX(
-        struct snake& snake, 
-        unsigned int x, 
-        unsigned int y) {
+EXTERNC void snakeSetPrecision(
+        struct snake *snake,
+        enum snakePrecision precision) {
+    snake->precision = precision;
+    snakeOperator(snake, contourSize(&snake->con));
+}
 
-    return dip::SubpixelLocation(
-        snake.exteng.dip_force.TensorRow(0), 
-        { x, y }, 
-        dip::S::MAXIMUM,
-        dip::S::LINEAR).value;
+EXTERNC void snakeSetTolerance(
+        struct snake *snake,
+        enum snakeNorm norm,
+        double tol) {
+    snake->norm = norm;
+    snake->tol = tol;
 }
 
-static double getForceOnPointY(
-        struct snake& snake,
-        unsigned int x, 
-        unsigned int y) {
+// every < 0 or a spacing that is not positive (NaN included) when
+// resampling is on.
+static bool resamplingInvalid(int every, double spacing) {
+    return every < 0 || (every > 0 && !(spacing > 0));
+}
 
-    return dip::SubpixelLocation(
-        snake.exteng.dip_force.TensorRow(1), 
-        { x, y }, 
-        dip::S::MAXIMUM,
-        dip::S::LINEAR).value;
+EXTERNC int snakeSetResampling(
+        struct snake *snake,
+        int every,
+        double spacing) {
+    if (resamplingInvalid(every, spacing))
+        return -1;
+    snake->resample = every;
+    snake->spacing = spacing;
+    return 0;
 }
 
-static void updateContour(
-        struct snake& snake, 
-        const std::vector<double> fex, 
-        const std::vector<double> fey) {
+/// Fewest points a resampled contour may have.
+#define SNAKE_RESAMPLE_MIN_POINTS 8
+
+// Re-space the closed contour (x, y) by arc length: (ox, oy) gets the
+// point count closest to length / spacing, evenly spread along the
+// polygon of (x, y) starting at its first point.
+template <typename T>
+static void contourRespace(
+        const std::vector<T>& x,
+        const std::vector<T>& y,
+        double spacing,
+        std::vector<T>& ox,
+        std::vector<T>& oy) {
+    int n = x.size();
+    std::vector<double> len(n + 1, 0.0);
+    for (int i = 0; i < n; i++) {
+        int k = (i + 1) % n;
+        len[i + 1] = len[i] + std::hypot(x[k] - x[i], y[k] - y[i]);
+    }
+    // a diverged contour (length NaN or inf) keeps its point count
+    double count = len[n] / spacing;
+    int m = count < INT_MAX
+        ? std::max((int) std::lround(count), SNAKE_RESAMPLE_MIN_POINTS)
+        : n;
+    ox.resize(m);
+    oy.resize(m);
+    int j = 0;
+    for (int i = 0; i < m; i++) {
+        double t = len[n] * i / m;
+        while (j < n - 1 && len[j + 1] <= t)
+            j++;
+        int k = (j + 1) % n;
+        double seg = len[j + 1] - len[j];
+        double u = seg > 0 ? (t - len[j]) / seg : 0;
+        ox[i] = x[j] + u * (x[k] - x[j]);
+        oy[i] = y[j] + u * (y[k] - y[j]);
+    }
+}
 
-    int n = contourSize(&snake.con);
-    double new_conx[n];
-    double new_cony[n];
+// Largest or root mean square distance between the n points
+// (x[i], y[i]) and their previous positions (px[i], py[i]). NaN when
+// any point is NaN (a diverged snake), which the convergence tests
+// (d <= tol) take for still moving.
+template <typename T>
+static double displacement(
+        enum snakeNorm norm,
+        const T *x,
+        const T *y,
+        const T *px,
+        const T *py,
+        int n) {
+    double acc = 0;
     for (int i = 0; i < n; i++) {
-        double sumx = 0.0;
-        double sumy = 0.0;
-        for (int j = 0; j < n; j++) {
-            sumx += (
-                snake.con.x[j] + snake.gamma * fex[j]
-            ) * snake.mat[i * n + j];
-            sumy += (
-                snake.con.y[j] + snake.gamma * fey[j]
-            ) * snake.mat[i * n + j];
+        double dx = x[i] - px[i];
+        double dy = y[i] - py[i];
+        double d2 = dx * dx + dy * dy;
+        if (norm == SNAKE_NORM_MAX) {
+            // std::max would drop a NaN d2 and keep acc
+            if (d2 > acc || std::isnan(d2))
+                acc = d2;
+        } else {
+            acc += d2;
         }
-        new_conx[i] = sumx;
-        new_cony[i] = sumy;
     }
+    if (norm == SNAKE_NORM_RMS && n > 0)
+        acc /= n;
+    return sqrt(acc);
+}
+
+// Evolve con with the operator of st against field, up to niter
+// iterations, in precision T. Returns the number of iterations run.
+// When the snake resamples, con is re-spaced to spacing (in pixels of
+// field) every snake.resample iterations and st.mat replaced by the
+// operator of its new point count.
+template <typename T>
+static int evolveContour(
+        struct snake& snake,
+        struct contour& con,
+        struct snakeState<T>& st,
+        const struct forceField& field,
+        double spacing,
+        int niter) {
+    int n = contourSize(&con);
+    std::vector<T> x(con.x.begin(), con.x.end());
+    std::vector<T> y(con.y.begin(), con.y.end());
+    std::vector<T> fex(n);
+    std::vector<T> fey(n);
+    std::vector<T> px(n);
+    std::vector<T> py(n);
+    T gamma = snake.gamma;
+    int i = 0;
+    while (i < niter) {
+        if (snake.resample > 0 && i % snake.resample == 0) {
+            std::vector<T> ox;
+            std::vector<T> oy;
+            contourRespace(x, y, spacing, ox, oy);
+            x.swap(ox);
+            y.swap(oy);
+            if ((int) x.size() != n) {
+                n = x.size();
+                st.mat = internalGet<T>(
+                    snake.engine,
+                    snake.alpha,
+                    snake.beta,
+                    snake.gamma,
+                    n);
+                fex.resize(n);
+                fey.resize(n);
+                px.resize(n);
+                py.resize(n);
+            }
+        }
+        std::copy(x.begin(), x.end(), px.begin());
+        std::copy(y.begin(), y.end(), py.begin());
+        forceSampleSimd(field, x.data(), y.data(), n, fex.data(), fey.data());
+        for (int k = 0; k < n; k++) {
+            x[k] += gamma * fex[k];
+            y[k] += gamma * fey[k];
+        }
+        internalSolve(*st.mat, x.data(), y.data(), st.work);
+        i++;
+        double d = displacement(
+            snake.norm,
+            x.data(),
+            y.data(),
+            px.data(),
+            py.data(),
+            n);
+        if (d <= snake.tol)
+            break;
+    }
+    con.x.assign(x.begin(), x.end());
+    con.y.assign(y.begin(), y.end());
+    return i;
+}
+
+EXTERNC int snakeExec(struct snake *snake, int niter = 50) {
+    if (contourSize(&snake->con) < SNAKE_MIN_POINTS)
+        return 0;
+    if (snake->precision == SNAKE_PRECISION_FLOAT32)
+        return evolveContour(*snake, snake->con, snake->f32, *snake->field,
+            snake->spacing, niter);
+    return evolveContour(*snake, snake->con, snake->f64, *snake->field,
+        snake->spacing, niter);
+}
+
+/// Fewest points a contour may have on a coarse level.
+#define SNAKE_PYRAMID_MIN_POINTS 16
+
+// Resample the closed contour in to n points evenly spaced in point
+// index (linear in between) and scale the coordinates.
+static void contourResample(
+        const struct contour& in,
+        int n,
+        double scale,
+        struct contour& out) {
+    int m = in.x.size();
+    out.x.resize(n);
+    out.y.resize(n);
     for (int i = 0; i < n; i++) {
-        snake.con.x[i] = new_conx[i];
-        snake.con.y[i] = new_cony[i];
+        double t = (double) i * m / n;
+        int j = (int) t;
+        int k = (j + 1) % m;
+        double u = t - j;
+        out.x[i] = scale * (in.x[j] + u * (in.x[k] - in.x[j]));
+        out.y[i] = scale * (in.y[j] + u * (in.y[k] - in.y[j]));
     }
 }
 
-EXTERNC void snakeExec(struct snake *snake, int niter = 50) {
+// Evolve con on coarse level l with an operator of its own.
+template <typename T>
+static int evolveLevel(
+        struct snake& snake,
+        struct contour& con,
+        const struct forceField& field,
+        int l,
+        int niter) {
+    struct snakeState<T> st;
+    st.mat = internalGet<T>(
+        snake.engine,
+        snake.alpha,
+        snake.beta,
+        snake.gamma,
+        contourSize(&con));
+    double spacing = std::ldexp(snake.spacing, -l);
+    return evolveContour(snake, con, st, field, spacing, niter);
+}
+
+// Coarse to fine evolution over the force pyramid of the energy
+// given at snakeInit (energyCalculatePyramid). On level l the
+// contour has n / 2^l points (at least SNAKE_PYRAMID_MIN_POINTS) in
+// level pixels, resampled to the spacing scaled by 2^-l; it runs up
+// to niter iterations there, is upsampled and refined on the next
+// level. Returns the iterations run on the
+// full resolution level, which ends with the n points of the snake.
+EXTERNC int snakeExecPyramid(struct snake *snake, int niter) {
     int n = contourSize(&snake->con);
-    std::vector<double> fex(n);
-    std::vector<double> fey(n);
-    for (int i = 0; i < niter; i++) {
-        for (int j = 0; j < n; j++) {
-            unsigned int xcood = round(snake->con.x[j]);
-            unsigned int ycood = round(snake->con.y[j]);
-            fex[j] = getForceOnPointX(*snake, xcood, ycood);
-            fey[j] = getForceOnPointY(*snake, xcood, ycood);
-        }
-        updateContour(*snake, fex, fex);
+    int nlevels = snake->levels.size();
+    if (nlevels <= 1 || n < SNAKE_MIN_POINTS)
+        return snakeExec(snake, niter);
+
+    struct contour con;
+    int l = nlevels - 1;
+    int m = std::max(n >> l, std::min(n, SNAKE_PYRAMID_MIN_POINTS));
+    contourResample(snake->con, m, std::ldexp(1.0, -l), con);
+    for (; l > 0; l--) {
+        if (snake->precision == SNAKE_PRECISION_FLOAT32)
+            evolveLevel<float>(*snake, con, *snake->levels[l], l, niter);
+        else
+            evolveLevel<double>(*snake, con, *snake->levels[l], l, niter);
+        m = std::max(n >> (l - 1), std::min(n, SNAKE_PYRAMID_MIN_POINTS));
+        struct contour up;
+        contourResample(con, m, 2.0, up);
+        con = up;
     }
+    snake->con = con;
+    return snakeExec(snake, niter);
 }
 
 EXTERNC void snakeFree(struct snake *snake) {
     delete snake;
 }
 
+// Snake batch API
+// ========================================================
+// N contours stored back to back (structure of arrays) and evolved
+// together against one read-only force field. Snake i owns the points
+// [off[i], off[i + 1]) of the point arrays and uses the internal
+// energy operator op[i], shared through the operator cache. The
+// points live in the batchPoints of the precision of the batch, the
+// other one stays empty. During an exec, active lists the snakes
+// still moving and iters counts the iterations of each.
+template <typename T>
+struct batchPoints {
+    std::vector<T> x;
+    std::vector<T> y;
+    std::vector<T> fx;
+    std::vector<T> fy;
+    std::vector<T> px;
+    std::vector<T> py;
+    std::vector<std::shared_ptr<const struct internal<T>>> op;
+};
+
+struct snakeBatch {
+    std::shared_ptr<const struct forceField> field;
+    struct batchPoints<double> f64;
+    struct batchPoints<float> f32;
+    std::vector<int> off;
+    std::vector<int> iters;
+    std::vector<char> moving;
+    std::vector<int> active;
+    double alpha;
+    double beta;
+    double gamma;
+    enum snakeEngine engine;
+    enum snakePrecision precision;
+    enum snakeNorm norm;
+    double tol;
+    int resample;
+    double spacing;
+    enum snakeBackend backend;
+    struct clBatch *cl;
+    std::shared_ptr<const struct forceField> clField;
+};
+
+EXTERNC struct snakeBatch *snakeBatchNew() {
+    return new snakeBatch();
+}
+
+EXTERNC void snakeBatchInit(
+        struct snakeBatch *b,
+        struct energy *en,
+        double alpha,
+        double beta,
+        double gamma,
+        enum snakeEngine engine) {
+    b->field = en->field;
+    b->f64 = batchPoints<double>();
+    b->f32 = batchPoints<float>();
+    b->off.assign(1, 0);
+    b->iters.clear();
+    b->alpha = alpha;
+    b->beta = beta;
+    b->gamma = gamma;
+    b->engine = engine;
+    b->precision = SNAKE_PRECISION_FLOAT64;
+    b->norm = SNAKE_NORM_MAX;
+    b->tol = 0;
+    b->resample = 0;
+    b->spacing = 0;
+    b->backend = SNAKE_BACKEND_CPU;
+}
+
+EXTERNC void snakeBatchSetTolerance(
+        struct snakeBatch *b,
+        enum snakeNorm norm,
+        double tol) {
+    b->norm = norm;
+    b->tol = tol;
+}
+
+EXTERNC int snakeBatchSetResampling(
+        struct snakeBatch *b,
+        int every,
+        double spacing) {
+    if (resamplingInvalid(every, spacing))
+        return -1;
+    b->resample = every;
+    b->spacing = spacing;
+    return 0;
+}
+
+// Move the points and operators of from into to, converting them.
+template <typename T, typename U>
+static void batchConvert(
+        const struct snakeBatch& b,
+        struct batchPoints<U>& from,
+        struct batchPoints<T>& to) {
+    to.x.assign(from.x.begin(), from.x.end());
+    to.y.assign(from.y.begin(), from.y.end());
+    to.op.clear();
+    for (size_t i = 0; i + 1 < b.off.size(); i++)
+        to.op.push_back(internalGet<T>(
+            b.engine,
+            b.alpha,
+            b.beta,
+            b.gamma,
+            b.off[i + 1] - b.off[i]));
+    from = batchPoints<U>();
+}
+
+EXTERNC void snakeBatchSetPrecision(
+        struct snakeBatch *b,
+        enum snakePrecision precision) {
+    if (precision == b->precision)
+        return;
+    if (precision == SNAKE_PRECISION_FLOAT32)
+        batchConvert(*b, b->f64, b->f32);
+    else
+        batchConvert(*b, b->f32, b->f64);
+    b->precision = precision;
+}
+
+template <typename T>
+static void batchAdd(
+        struct snakeBatch& b,
+        struct batchPoints<T>& pts,
+        const struct contour& con) {
+    pts.x.insert(pts.x.end(), con.x.begin(), con.x.end());
+    pts.y.insert(pts.y.end(), con.y.begin(), con.y.end());
+    b.off.push_back(pts.x.size());
+    pts.op.push_back(internalGet<T>(
+        b.engine,
+        b.alpha,
+        b.beta,
+        b.gamma,
+        con.x.size()));
+}
+
+EXTERNC int snakeBatchAdd(struct snakeBatch *b, struct contour *con) {
+    if (contourSize(con) < SNAKE_MIN_POINTS)
+        return -1;
+    if (b->precision == SNAKE_PRECISION_FLOAT32)
+        batchAdd(*b, b->f32, *con);
+    else
+        batchAdd(*b, b->f64, *con);
+    b->iters.push_back(0);
+    return b->off.size() - 2;
+}
+
+EXTERNC int snakeBatchSize(struct snakeBatch *b) {
+    return b->off.size() - 1;
+}
+
+EXTERNC int snakeBatchIterations(struct snakeBatch *b, int i) {
+    return b->iters[i];
+}
+
+EXTERNC int snakeBatchConverged(struct snakeBatch *b, int i) {
+    return i < (int) b->moving.size() && !b->moving[i];
+}
+
+EXTERNC void snakeBatchSetEnergy(struct snakeBatch *b, struct energy *en) {
+    b->field = en->field;
+}
+
+EXTERNC void snakeBatchGetContour(
+        struct snakeBatch *b,
+        int i,
+        struct contour *con) {
+    int begin = b->off[i];
+    int end = b->off[i + 1];
+    if (b->precision == SNAKE_PRECISION_FLOAT32) {
+        con->x.assign(b->f32.x.begin() + begin, b->f32.x.begin() + end);
+        con->y.assign(b->f32.y.begin() + begin, b->f32.y.begin() + end);
+    } else {
+        con->x.assign(b->f64.x.begin() + begin, b->f64.x.begin() + end);
+        con->y.assign(b->f64.y.begin() + begin, b->f64.y.begin() + end);
+    }
+}
+
+// Sample forces and take the explicit external step on the
+// points [begin, end).
+template <typename T>
+static void batchExternal(
+        const struct snakeBatch& b,
+        struct batchPoints<T>& pts,
+        int begin,
+        int end) {
+    forceSampleSimd(
+        *b.field,
+        &pts.x[begin],
+        &pts.y[begin],
+        end - begin,
+        &pts.fx[begin],
+        &pts.fy[begin]);
+    T gamma = b.gamma;
+    for (int i = begin; i < end; i++) {
+        pts.x[i] += gamma * pts.fx[i];
+        pts.y[i] += gamma * pts.fy[i];
+    }
+}
+
+// Size the scratch arrays of pts to its points.
+template <typename T>
+static void batchScratch(struct batchPoints<T>& pts) {
+    size_t total = pts.x.size();
+    pts.fx.resize(total);
+    pts.fy.resize(total);
+    pts.px.resize(total);
+    pts.py.resize(total);
+}
+
+// Reset the iteration counts and make every snake active.
+template <typename T>
+static void batchStart(struct snakeBatch& b, struct batchPoints<T>& pts) {
+    int nsnakes = snakeBatchSize(&b);
+    batchScratch(pts);
+    b.iters.assign(nsnakes, 0);
+    b.moving.assign(nsnakes, 1);
+    b.active.resize(nsnakes);
+    std::iota(b.active.begin(), b.active.end(), 0);
+}
+
+// One iteration of snake i: external step, internal step and the
+// convergence test.
+template <typename T>
+static void batchStep(
+        struct snakeBatch& b,
+        struct batchPoints<T>& pts,
+        int i,
+        struct internalWork<T>& work) {
+    int begin = b.off[i];
+    int end = b.off[i + 1];
+    std::copy(pts.x.begin() + begin, pts.x.begin() + end,
+        pts.px.begin() + begin);
+    std::copy(pts.y.begin() + begin, pts.y.begin() + end,
+        pts.py.begin() + begin);
+    batchExternal(b, pts, begin, end);
+    internalSolve(*pts.op[i], &pts.x[begin], &pts.y[begin], work);
+    double d = displacement(
+        b.norm,
+        &pts.x[begin],
+        &pts.y[begin],
+        &pts.px[begin],
+        &pts.py[begin],
+        end - begin);
+    b.iters[i]++;
+    b.moving[i] = !(d <= b.tol);
+}
+
+// Re-space the snakes still moving and rebuild the point arrays
+// around their new point counts.
+template <typename T>
+static void batchResample(struct snakeBatch& b, struct batchPoints<T>& pts) {
+    int nsnakes = snakeBatchSize(&b);
+    std::vector<T> x;
+    std::vector<T> y;
+    std::vector<int> off(1, 0);
+    x.reserve(pts.x.size());
+    y.reserve(pts.y.size());
+    std::vector<T> inx;
+    std::vector<T> iny;
+    std::vector<T> outx;
+    std::vector<T> outy;
+    for (int i = 0; i < nsnakes; i++) {
+        int begin = b.off[i];
+        int end = b.off[i + 1];
+        inx.assign(pts.x.begin() + begin, pts.x.begin() + end);
+        iny.assign(pts.y.begin() + begin, pts.y.begin() + end);
+        if (b.moving[i]) {
+            contourRespace(inx, iny, b.spacing, outx, outy);
+            if ((int) outx.size() != end - begin)
+                pts.op[i] = internalGet<T>(
+                    b.engine,
+                    b.alpha,
+                    b.beta,
+                    b.gamma,
+                    outx.size());
+        } else {
+            outx = inx;
+            outy = iny;
+        }
+        x.insert(x.end(), outx.begin(), outx.end());
+        y.insert(y.end(), outy.begin(), outy.end());
+        off.push_back(x.size());
+    }
+    pts.x.swap(x);
+    pts.y.swap(y);
+    b.off.swap(off);
+    batchScratch(pts);
+}
+
+// Drop the snakes that have converged from the active set.
+static void batchCompact(struct snakeBatch& b) {
+    size_t k = 0;
+    for (int i : b.active)
+        if (b.moving[i])
+            b.active[k++] = i;
+    b.active.resize(k);
+}
+
+// OpenCL batch execution
+// ========================================================
+// With the OpenCL backend (clapi.h) the float points of the batch
+// live on the device during an exec: they are uploaded at its start
+// and only come back at its end, or when they are resampled on the
+// host. The field goes up once, when the batch first runs on it.
+#ifdef SNAKE_OPENCL
+static void clUploadField(struct snakeBatch& b) {
+    if (b.clField == b.field)
+        return;
+    const struct forceField& ff = *b.field;
+    if (ff.lazy) {
+        // one point per tile gets every block computed
+        std::vector<float> x;
+        std::vector<float> y;
+        for (int ty = 0; ty < ff.tilesY; ty++) {
+            for (int tx = 0; tx < ff.tilesX; tx++) {
+                x.push_back(std::min(tx * FORCE_TILE, ff.width - 2));
+                y.push_back(std::min(ty * FORCE_TILE, ff.height - 2));
+            }
+        }
+        forceFieldPrepare(ff, x.data(), y.data(), x.size());
+    }
+    size_t size = (size_t) ff.tilesX * ff.tilesY * FORCE_TILE_SIZE;
+    if (ff.type == SNAKE_FORCE_FLOAT32)
+        clBatchSetField(b.cl, ff.f32, size, ff.width, ff.height, ff.tilesX);
+    else {
+        std::vector<float> tiles(ff.f64, ff.f64 + size);
+        clBatchSetField(b.cl, tiles.data(), size, ff.width, ff.height,
+            ff.tilesX);
+    }
+    b.clField = b.field;
+}
+
+// Upload the points with the banded factors of their snakes laid out
+// like them.
+static void clUploadSnakes(struct snakeBatch& b) {
+    struct batchPoints<float>& pts = b.f32;
+    int nsnakes = snakeBatchSize(&b);
+    size_t total = pts.x.size();
+    std::vector<float> d(total);
+    std::vector<float> e(total);
+    std::vector<float> f(total);
+    std::vector<float> g(total);
+    std::vector<float> h(total);
+    std::vector<int> k(nsnakes);
+    for (int i = 0; i < nsnakes; i++) {
+        const struct pentadiag<float>& pd = pts.op[i]->pd;
+        std::copy(pd.d.begin(), pd.d.end(), d.begin() + b.off[i]);
+        std::copy(pd.e.begin(), pd.e.end(), e.begin() + b.off[i]);
+        std::copy(pd.f.begin(), pd.f.end(), f.begin() + b.off[i]);
+        std::copy(pd.g.begin(), pd.g.end(), g.begin() + b.off[i]);
+        std::copy(pd.h.begin(), pd.h.end(), h.begin() + b.off[i]);
+        k[i] = pd.k;
+    }
+    clBatchSetSnakes(
+        b.cl,
+        pts.x.data(),
+        pts.y.data(),
+        b.off.data(),
+        nsnakes,
+        d.data(),
+        e.data(),
+        f.data(),
+        g.data(),
+        h.data(),
+        k.data(),
+        b.moving.data());
+}
+
+// Whether an exec of b runs on the OpenCL device.
+static bool batchOnDevice(const struct snakeBatch& b) {
+    return b.backend == SNAKE_BACKEND_OPENCL
+        && b.precision == SNAKE_PRECISION_FLOAT32;
+}
+
+static int batchExecCL(struct snakeBatch& b, int niter) {
+    struct batchPoints<float>& pts = b.f32;
+    batchStart(b, pts);
+    bool current = false; // the device holds the latest points
+    int it = 0;
+    for (; it < niter && !b.active.empty(); it++) {
+        if (b.resample > 0 && it % b.resample == 0) {
+            if (current)
+                clBatchGetPoints(b.cl, pts.x.data(), pts.y.data());
+            batchResample(b, pts);
+            current = false;
+        }
+        if (!current) {
+            clUploadField(b);
+            clUploadSnakes(b);
+            current = true;
+        }
+        clBatchStep(b.cl, b.gamma, b.norm, b.tol, b.moving.data());
+        for (int i : b.active)
+            b.iters[i]++;
+        batchCompact(b);
+    }
+    if (current)
+        clBatchGetPoints(b.cl, pts.x.data(), pts.y.data());
+    return it;
+}
+#endif
+
+EXTERNC int snakeBatchSetBackend(
+        struct snakeBatch *b,
+        enum snakeBackend backend) {
+    if (backend == SNAKE_BACKEND_CPU) {
+        b->backend = backend;
+        return 0;
+    }
+#ifdef SNAKE_OPENCL
+    if (b->engine != SNAKE_ENGINE_BANDED)
+        return -1;
+    if (!b->cl)
+        b->cl = clBatchNew(FORCE_TILE_SHIFT);
+    if (!b->cl)
+        return -1;
+    snakeBatchSetPrecision(b, SNAKE_PRECISION_FLOAT32);
+    b->backend = backend;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+template <typename T>
+static int batchExec(
+        struct snakeBatch& b,
+        struct batchPoints<T>& pts,
+        int niter) {
+    struct internalWork<T> work;
+    batchStart(b, pts);
+    int it = 0;
+    for (; it < niter && !b.active.empty(); it++) {
+        if (b.resample > 0 && it % b.resample == 0)
+            batchResample(b, pts);
+        for (int i : b.active)
+            batchStep(b, pts, i, work);
+        batchCompact(b);
+    }
+    return it;
+}
+
+EXTERNC int snakeBatchExec(struct snakeBatch *b, int niter) {
+#ifdef SNAKE_OPENCL
+    if (batchOnDevice(*b))
+        return batchExecCL(*b, niter);
+#endif
+    if (b->precision == SNAKE_PRECISION_FLOAT32)
+        return batchExec(*b, b->f32, niter);
+    return batchExec(*b, b->f64, niter);
+}
+
+// Parallel batch execution
+// ========================================================
+// Every iteration runs the active snakes on the pool in chunks of
+// whole snakes, each task sampling forces and taking the internal
+// step of its snakes, and is closed by waiting on a wait group. The
+// converged snakes are then dropped and the chunks rebuilt. The
+// points and the force field are single allocations, so chunks go to
+// the pool like any other task (round robin over the nodes of a NUMA
+// partitioned pool), none of them is closer to one node than another.
+
+/// Points per task, snakes are grouped until they reach it.
+#define SNAKE_BATCH_CHUNK 4096
+
+// Active snakes active[begin, end), with scratch space for either
+// precision.
+struct batchChunk {
+    struct snakeBatch *b;
+    int begin;
+    int end;
+    struct internalWork<double> work64;
+    struct internalWork<float> work32;
+};
+
+static void batchStepTask(void *arg) {
+    struct batchChunk *c = (struct batchChunk *) arg;
+    struct snakeBatch& b = *c->b;
+    for (int k = c->begin; k < c->end; k++) {
+        if (b.precision == SNAKE_PRECISION_FLOAT32)
+            batchStep(b, b.f32, b.active[k], c->work32);
+        else
+            batchStep(b, b.f64, b.active[k], c->work64);
+    }
+}
+
+// Group the active snakes into chunks, reusing the scratch space
+// of the chunks of the previous iteration.
+static void batchChunks(
+        struct snakeBatch& b,
+        std::vector<struct batchChunk>& chunks) {
+    int nactive = b.active.size();
+    size_t c = 0;
+    for (int k = 0; k < nactive;) {
+        int first = b.active[k];
+        int points = b.off[first + 1] - b.off[first];
+        int j = k + 1;
+        while (j < nactive) {
+            int n = b.off[b.active[j] + 1] - b.off[b.active[j]];
+            if (points + n > SNAKE_BATCH_CHUNK)
+                break;
+            points += n;
+            j++;
+        }
+        if (c == chunks.size())
+            chunks.emplace_back();
+        chunks[c].b = &b;
+        chunks[c].begin = k;
+        chunks[c].end = j;
+        c++;
+        k = j;
+    }
+    chunks.resize(c);
+}
+
+static void batchRun(
+        struct pool *p,
+        std::vector<struct batchChunk>& chunks,
+        struct waitGroup& wg,
+        taskFn fn) {
+    for (size_t i = 0; i < chunks.size(); i++) {
+        struct task t = { fn, &chunks[i], &wg };
+        poolAddTask(p, t);
+    }
+    waitGroupWait(&wg);
+}
+
+template <typename T>
+static int batchExecPool(
+        struct snakeBatch& b,
+        struct batchPoints<T>& pts,
+        struct pool *p,
+        int niter) {
+    std::vector<struct batchChunk> chunks;
+    struct waitGroup wg;
+    waitGroupInit(&wg);
+    batchStart(b, pts);
+    int it = 0;
+    for (; it < niter && !b.active.empty(); it++) {
+        if (b.resample > 0 && it % b.resample == 0)
+            batchResample(b, pts);
+        batchChunks(b, chunks);
+        batchRun(p, chunks, wg, batchStepTask);
+        batchCompact(b);
+    }
+    waitGroupFree(&wg);
+    return it;
+}
+
+EXTERNC int snakeBatchExecPool(
+        struct snakeBatch *b,
+        struct pool *p,
+        int niter) {
+#ifdef SNAKE_OPENCL
+    if (batchOnDevice(*b))
+        return batchExecCL(*b, niter);
+#endif
+    if (b->precision == SNAKE_PRECISION_FLOAT32)
+        return batchExecPool(*b, b->f32, p, niter);
+    return batchExecPool(*b, b->f64, p, niter);
+}
+
+EXTERNC void snakeBatchFree(struct snakeBatch *b) {
+#ifdef SNAKE_OPENCL
+    if (b->cl)
+        clBatchFree(b->cl);
+#endif
+    delete b;
+}
+
 #ifdef SNAKE_STANDALONE
 int main(int argc, char **argv) {
     if (argc != 2) {
@@ -292,7 +1313,7 @@ int main(int argc, char **argv) {
     contourCreate(&con);
     energyInit(&en);
     energyCalculateForce(&en, &im, 30.0);
-    snakeInit(&snake, &im, &con, &en, 0.001, 0.4, 100);
+    snakeInit(&snake, &con, &en, 0.001, 0.4, 100, SNAKE_ENGINE_BANDED);
     snakeExec(&snake);
 
     return 0;
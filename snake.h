@@ -12,11 +12,27 @@
 // #define SNAKE_STANDALONE
 // ========================
 
+// ========================
+// Lifetimes
+// ------------------------
+// Images, contours and energies belong to the caller. An energy holds
+// a reference counted force field; snakeInit and snakeBatchInit take
+// a reference to it and copy the contour, so im, con and en may be
+// freed (or en recomputed) right after init. Snakes never keep the
+// image. Creating a snake costs O(contour), not O(image).
+// ========================
+
 struct image;
 
 EXTERNC struct image *imageNew();
 EXTERNC void imageInit(struct image *im);
 EXTERNC void imageRead(struct image *im, const char *filename);
+// Copy of the width x height float pixels (row major, x fastest).
+EXTERNC void imageSetData(
+        struct image *im,
+        const float *data,
+        int width,
+        int height);
 EXTERNC unsigned char *imageGetData(struct image *im);
 EXTERNC int imageWidth(struct image *im);
 EXTERNC int imageHeight(struct image *im);
@@ -28,32 +44,251 @@ EXTERNC struct contour *contourNew();
 EXTERNC void contourInit(struct contour *con, int size);
 EXTERNC void contourPush(struct contour *con, double x, double y);
 EXTERNC int contourSize(struct contour *con);
+EXTERNC void contourGetPoint(
+        struct contour *con,
+        int i,
+        double *x,
+        double *y);
 EXTERNC void contourFree(struct contour *con);
 
 struct energy;
+struct pool;
 
+// Precision the force field of an energy is stored in, float by
+// default.
+enum snakeForceType {
+    SNAKE_FORCE_FLOAT32,
+    SNAKE_FORCE_FLOAT64
+};
+
+// The force is the gradient of the gradient magnitude at scale sigma,
+// computed with recursive filters whose cost does not depend on
+// sigma. The pool variant spreads it over the running workers of p.
+// The lazy variant computes nothing up front: every block of the
+// force is computed the first time a snake samples it, and kept for
+// every later snake on the energy.
 EXTERNC struct energy *energyNew();
 EXTERNC void energyInit(struct energy *en);
+EXTERNC void energySetForceType(
+        struct energy *en,
+        enum snakeForceType type);
 EXTERNC void energyCalculateForce(
         struct energy *enptr, 
         struct image *imptr, 
         double sigma);
+EXTERNC void energyCalculateForcePool(
+        struct energy *enptr,
+        struct image *imptr,
+        double sigma,
+        struct pool *p);
+EXTERNC void energyCalculateForceLazy(
+        struct energy *enptr,
+        struct image *imptr,
+        double sigma);
+// Same force as energyCalculateForce, kept on disk in dir (which must
+// exist) under the image content and sigma: a later call for the same
+// image and sigma maps the file instead of computing the force. Files
+// that are missing, stale or unreadable are recomputed and rewritten.
+// Returns 1 when the force came from the cache, 0 otherwise. The
+// pool variant computes a missing force on the workers of p.
+EXTERNC int energyLoadOrCalculateForce(
+        struct energy *enptr,
+        struct image *imptr,
+        double sigma,
+        const char *dir);
+EXTERNC int energyLoadOrCalculateForcePool(
+        struct energy *enptr,
+        struct image *imptr,
+        double sigma,
+        const char *dir,
+        struct pool *p);
+// Gradient vector flow (gvf.h): the force above at sigma, diffused
+// over the image with smoothness mu (0.1 to 0.3, higher spreads it
+// further) by niter sweeps of a multigrid-started SOR solver. Snakes
+// are pulled towards edges from much further away, so a small sigma
+// (1 to 4) is enough. The cached variant keys the file on mu and
+// niter as well.
+EXTERNC void energyCalculateGVF(
+        struct energy *enptr,
+        struct image *imptr,
+        double sigma,
+        double mu,
+        int niter);
+EXTERNC void energyCalculateGVFPool(
+        struct energy *enptr,
+        struct image *imptr,
+        double sigma,
+        double mu,
+        int niter,
+        struct pool *p);
+EXTERNC int energyLoadOrCalculateGVF(
+        struct energy *enptr,
+        struct image *imptr,
+        double sigma,
+        double mu,
+        int niter,
+        const char *dir);
+EXTERNC int energyLoadOrCalculateGVFPool(
+        struct energy *enptr,
+        struct image *imptr,
+        double sigma,
+        double mu,
+        int niter,
+        const char *dir,
+        struct pool *p);
+// Force pyramid of nlevels levels, each one half the size of the one
+// above it; snakeExecPyramid evolves coarse to fine over it.
+EXTERNC void energyCalculatePyramid(
+        struct energy *enptr,
+        struct image *imptr,
+        double sigma,
+        int nlevels);
+EXTERNC int energyLevels(struct energy *en);
 EXTERNC void energyFree(struct energy *en);
 
+// ========================
+// Convergence
+// ------------------------
+// A snake has converged once the largest (SNAKE_NORM_MAX) or the
+// root mean square (SNAKE_NORM_RMS) point displacement of one
+// iteration is at most tol; niter of the exec functions is then only
+// a cap. The default tolerance 0 runs every snake up to the cap.
+// ========================
+
 struct snake;
 
+enum snakeNorm {
+    SNAKE_NORM_MAX,
+    SNAKE_NORM_RMS
+};
+
+enum snakeEngine {
+    SNAKE_ENGINE_BANDED,
+    SNAKE_ENGINE_FFT,
+    SNAKE_ENGINE_DENSE
+};
+
+// Precision an exec computes in: contour points, sampled forces and
+// the internal operator. Contours are double on the API side either
+// way; float halves the memory traffic of every iteration and doubles
+// the points per SIMD register, which pixel level contours do not
+// notice. Double by default.
+enum snakePrecision {
+    SNAKE_PRECISION_FLOAT64,
+    SNAKE_PRECISION_FLOAT32
+};
+
+/// Fewest points of a contour, the internal energy operators need
+/// two neighbours on either side of every point.
+#define SNAKE_MIN_POINTS 5
+
+// snakeInit and snakeSetContour return -1 (and leave the snake
+// without a contour, execs then run no iterations) when con has fewer
+// than SNAKE_MIN_POINTS points, 0 otherwise.
 EXTERNC struct snake *snakeNew();
-EXTERNC void snakeInit(
+EXTERNC int snakeInit(
         struct snake *snake, 
-        struct image *im, 
         struct contour *con, 
         struct energy *en,
         double alpha,
         double beta,
-        double gamma);
-EXTERNC void snakeSetContour(struct snake *snake, struct contour *con);
+        double gamma,
+        enum snakeEngine engine);
+EXTERNC int snakeSetContour(struct snake *snake, struct contour *con);
 EXTERNC struct contour *snakeGetContour(struct snake *snake);
-EXTERNC void snakeExec(struct snake *snake, int niter);
+EXTERNC void snakeSetPrecision(
+        struct snake *snake,
+        enum snakePrecision precision);
+EXTERNC void snakeSetTolerance(
+        struct snake *snake,
+        enum snakeNorm norm,
+        double tol);
+// Every `every` iterations of an exec (0, the default, never) the
+// contour is re-spaced by arc length to points about spacing pixels
+// apart, so the point count follows the length of the snake instead
+// of being fixed at creation. Operators for the new counts come from
+// the operator cache. Spacing is in pixels of the full resolution
+// image, the coarse levels of snakeExecPyramid scale it to theirs.
+// Returns -1 (and changes nothing) for every < 0, or every > 0 with
+// spacing <= 0.
+EXTERNC int snakeSetResampling(
+        struct snake *snake,
+        int every,
+        double spacing);
+EXTERNC int snakeExec(struct snake *snake, int niter);
+EXTERNC int snakeExecPyramid(struct snake *snake, int niter);
 EXTERNC void snakeFree(struct snake *snake);
 
+// Batch of snakes evolved together against one shared energy.
+// Contours are copied in by snakeBatchAdd (returns the snake index,
+// or -1 for a contour of fewer than SNAKE_MIN_POINTS points, which is
+// not added) and out by snakeBatchGetContour. Converged snakes drop out of the
+// batch, later iterations only pay for the ones still moving. The
+// exec functions return the number of iterations run, which is the
+// count of the slowest snake; snakeBatchIterations gives the count
+// of every snake in the last exec and snakeBatchConverged whether it
+// passed the tolerance test there (one that passes on the last
+// iteration allowed has converged, one stuck at the cap has not).
+struct snakeBatch;
+
+EXTERNC struct snakeBatch *snakeBatchNew();
+EXTERNC void snakeBatchInit(
+        struct snakeBatch *b,
+        struct energy *en,
+        double alpha,
+        double beta,
+        double gamma,
+        enum snakeEngine engine);
+EXTERNC int snakeBatchAdd(struct snakeBatch *b, struct contour *con);
+EXTERNC int snakeBatchSize(struct snakeBatch *b);
+EXTERNC void snakeBatchGetContour(
+        struct snakeBatch *b,
+        int i,
+        struct contour *con);
+EXTERNC void snakeBatchSetTolerance(
+        struct snakeBatch *b,
+        enum snakeNorm norm,
+        double tol);
+// Converts the snakes already added.
+EXTERNC void snakeBatchSetPrecision(
+        struct snakeBatch *b,
+        enum snakePrecision precision);
+// Resampling (see snakeSetResampling) of the snakes still moving.
+EXTERNC int snakeBatchSetResampling(
+        struct snakeBatch *b,
+        int every,
+        double spacing);
+EXTERNC int snakeBatchExec(struct snakeBatch *b, int niter);
+EXTERNC int snakeBatchIterations(struct snakeBatch *b, int i);
+EXTERNC int snakeBatchConverged(struct snakeBatch *b, int i);
+// Move the batch onto another energy (the next frame of a sequence):
+// the snakes start the next exec from where the last one left them.
+EXTERNC void snakeBatchSetEnergy(struct snakeBatch *b, struct energy *en);
+
+// Backend the exec functions of a batch run on. SNAKE_BACKEND_OPENCL
+// (built with SNAKE_OPENCL, clapi.h) runs the force sampling and the
+// banded internal step of every snake as OpenCL kernels, any device
+// including CPU runtimes; it needs SNAKE_ENGINE_BANDED and switches
+// the batch to SNAKE_PRECISION_FLOAT32 (a batch set back to double
+// runs on the CPU). snakeBatchExecPool then leaves p alone. Returns 0
+// when the batch now runs on backend and -1 when that is not
+// available, the batch then keeps its backend.
+enum snakeBackend {
+    SNAKE_BACKEND_CPU,
+    SNAKE_BACKEND_OPENCL
+};
+
+EXTERNC int snakeBatchSetBackend(
+        struct snakeBatch *b,
+        enum snakeBackend backend);
+
+// Same as snakeBatchExec with the work spread over the workers of p,
+// which must already be running (poolCreateWorkers).
+
+EXTERNC int snakeBatchExecPool(
+        struct snakeBatch *b,
+        struct pool *p,
+        int niter);
+EXTERNC void snakeBatchFree(struct snakeBatch *b);
+
 #endif
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <assert.h>
+#include <math.h>
+
+#include "../snake.h"
+
+/// A contour with a NaN point never passes the convergence test: it
+/// runs up to the cap, single or in a batch, while a healthy snake
+/// next to it converges. A snake that converges on the last iteration
+/// allowed still counts as converged.
+#define SIZE 128
+#define NPOINTS 64
+#define NITER 200
+
+static struct contour *circle(double r, int nan) {
+    struct contour *con = contourNew();
+    contourInit(con, NPOINTS);
+    for (int i = 0; i < NPOINTS; i++) {
+        double t = 2 * M_PI * i / NPOINTS;
+        double x = SIZE / 2 + r * cos(t);
+        contourPush(con, nan && i == 0 ? NAN : x, SIZE / 2 + r * sin(t));
+    }
+    return con;
+}
+
+int main(int argc, char **argv) {
+    static float pixels[SIZE * SIZE];
+    for (int y = 0; y < SIZE; y++)
+        for (int x = 0; x < SIZE; x++)
+            pixels[y * SIZE + x] = hypot(x - SIZE / 2, y - SIZE / 2) < 30;
+    struct image *im = imageNew();
+    imageInit(im);
+    imageSetData(im, pixels, SIZE, SIZE);
+    struct energy *en = energyNew();
+    energyInit(en);
+    energyCalculateForce(en, im, 2.0);
+    imageFree(im);
+
+    struct contour *good = circle(36, 0);
+    struct contour *bad = circle(36, 1);
+
+    enum snakeNorm norms[] = { SNAKE_NORM_MAX, SNAKE_NORM_RMS };
+    for (int k = 0; k < 2; k++) {
+        struct snake *s = snakeNew();
+        int ok = snakeInit(s, bad, en, 0.001, 0.4, 1, SNAKE_ENGINE_BANDED);
+        assert(ok == 0);
+        snakeSetTolerance(s, norms[k], 0.1);
+        int iters = snakeExec(s, NITER);
+        assert(iters == NITER);
+        snakeFree(s);
+
+        struct snakeBatch *b = snakeBatchNew();
+        snakeBatchInit(b, en, 0.001, 0.4, 1, SNAKE_ENGINE_BANDED);
+        snakeBatchSetTolerance(b, norms[k], 0.1);
+        int ig = snakeBatchAdd(b, good);
+        int ib = snakeBatchAdd(b, bad);
+        assert(ig == 0 && ib == 1);
+        snakeBatchExec(b, NITER);
+        int settle = snakeBatchIterations(b, 0);
+        assert(settle < NITER && snakeBatchConverged(b, 0));
+        assert(snakeBatchIterations(b, 1) == NITER);
+        assert(!snakeBatchConverged(b, 1));
+        snakeBatchFree(b);
+
+        // capped right at and right before the iteration it settles on
+        for (int cap = settle; cap >= settle - 1; cap--) {
+            b = snakeBatchNew();
+            snakeBatchInit(b, en, 0.001, 0.4, 1, SNAKE_ENGINE_BANDED);
+            snakeBatchSetTolerance(b, norms[k], 0.1);
+            snakeBatchAdd(b, good);
+            snakeBatchExec(b, cap);
+            assert(snakeBatchIterations(b, 0) == cap);
+            assert(snakeBatchConverged(b, 0) == (cap == settle));
+            snakeBatchFree(b);
+        }
+    }
+
+    contourFree(good);
+    contourFree(bad);
+    energyFree(en);
+    printf("diverged snakes run to the cap\n");
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "../util.h"
+
+/// npyRead takes 2D arrays in either order, the Fortran order
+/// cpp/image.npy included, and dies on other shapes.
+
+// Writes a version 1 .npy file of the float32 values v under the
+// shape and order, returns its name.
+static char *npyWrite(const char *shape, int fortran, const float *v, int n) {
+    static char name[64];
+    strcpy(name, "/tmp/test-npy-XXXXXX");
+    int fd = mkstemp(name);
+    assert(fd >= 0);
+    char header[128];
+    int len = snprintf(header, sizeof(header),
+        "{'descr': '<f4', 'fortran_order': %s, 'shape': %s, }",
+        fortran ? "True" : "False", shape);
+    // padded with spaces and a newline to a multiple of 64 bytes
+    int hlen = (10 + len + 1 + 63) / 64 * 64 - 10;
+    memset(header + len, ' ', hlen - len - 1);
+    header[hlen - 1] = '\n';
+    unsigned char pre[10] = { 0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0,
+        hlen & 0xff, hlen >> 8 };
+    FILE *file = fdopen(fd, "wb");
+    fwrite(pre, 1, 10, file);
+    fwrite(header, 1, hlen, file);
+    fwrite(v, sizeof(float), n, file);
+    fclose(file);
+    return name;
+}
+
+// Whether npyRead dies on the file.
+static int dies(const char *name) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stderr);
+        int width, height;
+        npyRead(name, &width, &height);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 1;
+}
+
+int main(int argc, char **argv) {
+    int width, height;
+    float *pixels = npyRead("cpp/image.npy", &width, &height);
+    assert(width == 256 && height == 256);
+    // first row and first column, which differ
+    assert(pixels[1] == 144.1356201171875f);
+    assert(pixels[256] == 127.87696075439453f);
+    assert(pixels[200 * 256 + 10] == 130.87213134765625f);
+    free(pixels);
+
+    // the 2x3 array 0 1 2 / 3 4 5 in both orders
+    float c[] = { 0, 1, 2, 3, 4, 5 };
+    float f[] = { 0, 3, 1, 4, 2, 5 };
+    for (int fortran = 0; fortran < 2; fortran++) {
+        char *name = npyWrite("(2, 3)", fortran, fortran ? f : c, 6);
+        pixels = npyRead(name, &width, &height);
+        unlink(name);
+        assert(width == 3 && height == 2);
+        assert(memcmp(pixels, c, sizeof(c)) == 0);
+        free(pixels);
+    }
+
+    const char *bad[] = { "(2, 3, 1)", "(6,)", "()", "(1, 6)", "(6, 1)" };
+    for (int i = 0; i < 5; i++) {
+        char *name = npyWrite(bad[i], 0, c, 6);
+        int died = dies(name);
+        unlink(name);
+        assert(died);
+    }
+
+    printf("npy files read in both orders\n");
+    return 0;
+}
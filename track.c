@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <dirent.h>
+
+#include "util.h"
+#include "snake.h"
+#include "pool/pool.h"
+
+// ========================================================
+// Frame sources
+// ========================================================
+// Frames come either from the .ics and .npy files of a directory, in
+// name order, or from a raw stream of 8 bit gray frames on stdin
+// (ffmpeg -f rawvideo -pix_fmt gray).
+enum sourceType {
+    SOURCE_DIR,
+    SOURCE_RAW
+};
+
+struct source {
+    enum sourceType type;
+    char **files;
+    int nfiles;
+    int next;
+    int width;
+    int height;
+    unsigned char *raw;
+    float *pixels;
+};
+
+static int hasSuffix(const char *s, const char *suffix) {
+    size_t n = strlen(s);
+    size_t m = strlen(suffix);
+    return n >= m && !strcmp(s + n - m, suffix);
+}
+
+static int compareNames(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static void sourceInitDir(struct source *src, const char *dirname) {
+    DIR *dir = opendir(dirname);
+    if (!dir)
+        DIE("Could not open directory: %s\n", dirname);
+    memset(src, 0, sizeof(*src));
+    src->type = SOURCE_DIR;
+    struct dirent *e;
+    while ((e = readdir(dir))) {
+        if (!hasSuffix(e->d_name, ".ics") && !hasSuffix(e->d_name, ".npy"))
+            continue;
+        src->files = realloc(src->files, sizeof(char *) * (src->nfiles + 1));
+        if (!src->files)
+            DIE("Memory error\n");
+        size_t len = strlen(dirname) + strlen(e->d_name) + 2;
+        char *path = malloc(len);
+        if (!path)
+            DIE("Memory error\n");
+        snprintf(path, len, "%s/%s", dirname, e->d_name);
+        src->files[src->nfiles++] = path;
+    }
+    closedir(dir);
+    qsort(src->files, src->nfiles, sizeof(char *), compareNames);
+}
+
+static void sourceInitRaw(struct source *src, int width, int height) {
+    memset(src, 0, sizeof(*src));
+    src->type = SOURCE_RAW;
+    src->width = width;
+    src->height = height;
+    src->raw = malloc((size_t) width * height);
+    src->pixels = malloc(sizeof(float) * width * height);
+    if (!src->raw || !src->pixels)
+        DIE("Memory error\n");
+}
+
+// Reads the next frame into im, returns 0 when there is none.
+static int sourceNext(struct source *src, struct image *im) {
+    if (src->type == SOURCE_DIR) {
+        if (src->next >= src->nfiles)
+            return 0;
+        const char *filename = src->files[src->next++];
+        if (hasSuffix(filename, ".npy")) {
+            int width, height;
+            float *pixels = npyRead(filename, &width, &height);
+            imageSetData(im, pixels, width, height);
+            free(pixels);
+        } else
+            imageRead(im, filename);
+        return 1;
+    }
+    size_t n = (size_t) src->width * src->height;
+    if (fread(src->raw, 1, n, stdin) != n)
+        return 0;
+    for (size_t i = 0; i < n; i++)
+        src->pixels[i] = src->raw[i];
+    imageSetData(im, src->pixels, src->width, src->height);
+    return 1;
+}
+
+static void sourceFree(struct source *src) {
+    for (int i = 0; i < src->nfiles; i++)
+        free(src->files[i]);
+    free(src->files);
+    free(src->raw);
+    free(src->pixels);
+}
+
+// ========================================================
+// Tracking
+// ========================================================
+// The force of frame k + 1 is computed by one pool task while the
+// other workers evolve the snakes on frame k; the snakes then move
+// on to frame k + 1 from where frame k left them, so once they have
+// locked on they only need a few iterations per frame.
+struct frameJob {
+    struct source *src;
+    struct image *im;
+    struct energy *en;
+    double sigma;
+    int ok;
+};
+
+static void loadFrame(void *arg) {
+    struct frameJob *job = arg;
+    job->ok = sourceNext(job->src, job->im);
+    if (job->ok)
+        energyCalculateForce(job->en, job->im, job->sigma);
+}
+
+struct circle {
+    double x;
+    double y;
+    double r;
+};
+
+#define TRACK_MAX_SNAKES 256
+
+struct trackOptions {
+    struct circle circles[TRACK_MAX_SNAKES];
+    int ncircles;
+    int npoints;
+    double sigma;
+    int niter;
+    double tol;
+    enum snakeBackend backend;
+};
+
+static void printContours(struct snakeBatch *b, int frame) {
+    struct contour *con = contourNew();
+    for (int s = 0; s < snakeBatchSize(b); s++) {
+        snakeBatchGetContour(b, s, con);
+        for (int i = 0; i < contourSize(con); i++) {
+            double x, y;
+            contourGetPoint(con, i, &x, &y);
+            printf("%d %d %g %g\n", frame, s, x, y);
+        }
+    }
+    contourFree(con);
+}
+
+static void track(struct source *src, struct trackOptions *opt) {
+    struct pool p;
+    poolInit(&p);
+    poolCreateWorkers(&p);
+
+    struct image *im = imageNew();
+    struct energy *en = energyNew();
+    imageInit(im);
+    energyInit(en);
+    struct frameJob job = { src, im, en, opt->sigma, 0 };
+    loadFrame(&job);
+    if (!job.ok)
+        DIE("No frames\n");
+
+    if (!opt->ncircles) {
+        int w = imageWidth(im);
+        int h = imageHeight(im);
+        opt->circles[0].x = w / 2.0;
+        opt->circles[0].y = h / 2.0;
+        opt->circles[0].r = 0.4 * (w < h ? w : h);
+        opt->ncircles = 1;
+    }
+    struct snakeBatch *b = snakeBatchNew();
+    snakeBatchInit(b, en, 0.001, 0.4, 100, SNAKE_ENGINE_BANDED);
+    snakeBatchSetTolerance(b, SNAKE_NORM_MAX, opt->tol);
+    if (snakeBatchSetBackend(b, opt->backend))
+        fprintf(stderr, "Backend not available, running on the CPU\n");
+    for (int s = 0; s < opt->ncircles; s++) {
+        struct circle c = opt->circles[s];
+        struct contour *con = contourNew();
+        for (int i = 0; i < opt->npoints; i++) {
+            double t = 2 * 3.14159265358979323846 * i / opt->npoints;
+            contourPush(con, c.x + c.r * cos(t), c.y + c.r * sin(t));
+        }
+        snakeBatchAdd(b, con);
+        contourFree(con);
+    }
+
+    for (int frame = 0; ; frame++) {
+        struct waitGroup wg;
+        waitGroupInit(&wg);
+        struct task t = { loadFrame, &job, &wg };
+        poolAddTask(&p, t);
+
+        int iters = snakeBatchExecPool(b, &p, opt->niter);
+        printContours(b, frame);
+        fprintf(stderr, "frame %d: %d iterations\n", frame, iters);
+
+        waitGroupWait(&wg);
+        waitGroupFree(&wg);
+        if (!job.ok)
+            break;
+        snakeBatchSetEnergy(b, en);
+    }
+
+    snakeBatchFree(b);
+    energyFree(en);
+    imageFree(im);
+    poolShutdown(&p);
+    poolDestroyWorkers(&p);
+    poolFree(&p);
+}
+
+static void printUsage(const char *pro_name) {
+    fprintf(stderr,
+        "Usage: %s [OPTION]... <DIR | ->\n" \
+        "\n"
+        "Tracks snakes over the .ics/.npy frames of DIR, or over raw\n"
+        "8 bit gray frames on stdin (-), and prints every contour as\n"
+        "'frame snake x y' lines.\n"
+        "\n"
+        "  --raw WxH        Size of the stdin frames\n"
+        "  --circle X,Y,R   Initial snake, may be repeated\n"
+        "                   (default one circle in the middle)\n"
+        "  --points N       Points per initial snake (64)\n"
+        "  --sigma S        Scale of the image force (30)\n"
+        "  --iter N         Iterations per frame at most (50)\n"
+        "  --tol T          Largest point move of a converged snake (0.05)\n"
+        "  --backend B      cpu or opencl (cpu)\n",
+        pro_name
+    );
+}
+
+int main(int argc, char **argv) {
+    struct trackOptions opt;
+    opt.ncircles = 0;
+    opt.npoints = 64;
+    opt.sigma = 30.0;
+    opt.niter = 50;
+    opt.tol = 0.05;
+    opt.backend = SNAKE_BACKEND_CPU;
+    int width = 0, height = 0;
+    const char *input = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!strcmp(arg, "-") || arg[0] != '-') {
+            input = arg;
+            continue;
+        }
+        if (!val) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        i++;
+        if (!strcmp(arg, "--raw")) {
+            if (sscanf(val, "%dx%d", &width, &height) != 2
+                    || width < 2 || height < 2) {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (!strcmp(arg, "--circle")) {
+            struct circle *c = &opt.circles[opt.ncircles];
+            if (opt.ncircles == TRACK_MAX_SNAKES
+                    || sscanf(val, "%lf,%lf,%lf", &c->x, &c->y, &c->r) != 3) {
+                printUsage(argv[0]);
+                return 1;
+            }
+            opt.ncircles++;
+        } else if (!strcmp(arg, "--points"))
+            opt.npoints = atoi(val);
+        else if (!strcmp(arg, "--sigma"))
+            opt.sigma = atof(val);
+        else if (!strcmp(arg, "--iter"))
+            opt.niter = atoi(val);
+        else if (!strcmp(arg, "--tol"))
+            opt.tol = atof(val);
+        else if (!strcmp(arg, "--backend") && !strcmp(val, "cpu"))
+            opt.backend = SNAKE_BACKEND_CPU;
+        else if (!strcmp(arg, "--backend") && !strcmp(val, "opencl"))
+            opt.backend = SNAKE_BACKEND_OPENCL;
+        else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (!input || (!strcmp(input, "-") && !width) || opt.npoints < 5) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    struct source src;
+    if (!strcmp(input, "-"))
+        sourceInitRaw(&src, width, height);
+    else
+        sourceInitDir(&src, input);
+    track(&src, &opt);
+    sourceFree(&src);
+    return 0;
+}
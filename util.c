@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <limits.h>
 
 #include "util.h"
 
@@ -52,3 +53,98 @@ char *readFile(const char *filename) {
     return buf;
 }
 
+// Reads the dimensions of the shape tuple at shape into dims, at most
+// max of them; returns how many there are, or -1 if it is not a tuple
+// of non-negative integers.
+static int npyShape(const char *shape, long *dims, int max) {
+    const char *p = strchr(shape, '(');
+    if (!p)
+        return -1;
+    int ndim = 0;
+    for (p++; ; ) {
+        while (*p == ' ')
+            p++;
+        if (*p == ')')
+            return ndim;
+        char *end;
+        long d = strtol(p, &end, 10);
+        if (end == p || d < 0)
+            return -1;
+        if (ndim < max)
+            dims[ndim] = d;
+        ndim++;
+        for (p = end; *p == ' '; p++)
+            ;
+        if (*p == ',')
+            p++;
+        else if (*p != ')')
+            return -1;
+    }
+}
+
+float *npyRead(const char *filename, int *width, int *height) {
+    FILE *file = fopen(filename, "rb");
+    if (!file)
+        DIE("Could not read file: %s\n", filename);
+    unsigned char pre[10];
+    if (fread(pre, 1, 10, file) != 10 || memcmp(pre, "\x93NUMPY", 6))
+        DIE("Not a .npy file: %s\n", filename);
+    size_t hlen = pre[8] | pre[9] << 8;
+    if (pre[6] >= 2) {
+        unsigned char ext[2];
+        if (fread(ext, 1, 2, file) != 2)
+            DIE("Not a .npy file: %s\n", filename);
+        hlen |= (size_t) ext[0] << 16 | (size_t) ext[1] << 24;
+    }
+    char *header = malloc(hlen + 1);
+    if (!header)
+        DIE("Memory error\n");
+    if (fread(header, 1, hlen, file) != hlen)
+        DIE("Truncated .npy file: %s\n", filename);
+    header[hlen] = '\0';
+
+    char *descr = strstr(header, "'descr':");
+    char *shape = strstr(header, "'shape':");
+    long dims[2];
+    if (!descr || !shape || npyShape(shape, dims, 2) != 2)
+        DIE("Unsupported .npy header: %s\n", filename);
+    if (dims[0] < 2 || dims[1] < 2 || dims[0] > INT_MAX || dims[1] > INT_MAX)
+        DIE("Unsupported .npy size %ldx%ld: %s\n",
+            dims[1], dims[0], filename);
+    *height = dims[0];
+    *width = dims[1];
+    int fortran = strstr(header, "'fortran_order': True") != NULL;
+    size_t elem = 0;
+    if (strstr(descr, "'<f4'"))
+        elem = 4;
+    else if (strstr(descr, "'<f8'"))
+        elem = 8;
+    else if (strstr(descr, "'|u1'"))
+        elem = 1;
+    else
+        DIE("Unsupported .npy type: %s\n", filename);
+    free(header);
+
+    size_t n = (size_t) *width * *height;
+    unsigned char *buf = malloc(n * elem);
+    float *pixels = malloc(sizeof(float) * n);
+    if (!buf || !pixels)
+        DIE("Memory error\n");
+    if (fread(buf, elem, n, file) != n)
+        DIE("Truncated .npy file: %s\n", filename);
+    fclose(file);
+    // a Fortran order file holds the columns one after the other
+    for (size_t i = 0; i < n; i++) {
+        size_t j = fortran ? i % *height * *width + i / *height : i;
+        if (elem == 4)
+            memcpy(&pixels[j], buf + 4 * i, 4);
+        else if (elem == 8) {
+            double v;
+            memcpy(&v, buf + 8 * i, 8);
+            pixels[j] = v;
+        } else
+            pixels[j] = buf[i];
+    }
+    free(buf);
+    return pixels;
+}
@@ -9,4 +9,9 @@ void die(const char *file, int line, const char *fmt, ...);
 
 char *readFile(const char *filename);
 
+// Reads a 2D little endian .npy array of float32, float64 or uint8,
+// in C or Fortran order, as malloc'ed float pixels (row major, x
+// fastest). Dies on anything else and on arrays under 2x2.
+float *npyRead(const char *filename, int *width, int *height);
+
 #endif